@@ -24,263 +24,6205 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE /* For CPU affinity and RTLD_NEXT */
+
 #include <stdio.h>
+#include <errno.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <libavutil/avutil.h>
+#include <libavutil/avstring.h>
 #include <libavutil/time.h>
+#include <libavutil/threadmessage.h>
 #include <libavutil/pixdesc.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/cpu.h>
+#include <libavutil/bswap.h>
+#include <libavutil/opt.h>
+#include <libavutil/parseutils.h>
 #include <libavutil/hwcontext.h>
+#include <libavutil/hwcontext_vulkan.h>
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersrc.h>
+#include <libavfilter/buffersink.h>
 #include <libswscale/swscale.h>
 
-static int decode_frame(AVCodecContext *dec, const AVPacket *pkt, AVFrame *frame)
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_REPACK_AVX2 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_REPACK_NEON 1
+#endif
+
+/* Reads the next packet belonging to stream sid. At the end of the file,
+ * seeks back to the start and carries on if loop is set. */
+static int read_packet(AVFormatContext *in_ctx, int sid, int loop, AVPacket *pkt)
+{
+    int ret, rewound = 0;
+
+    for (;;) {
+        ret = av_read_frame(in_ctx, pkt);
+        if (ret == AVERROR_EOF && loop && !rewound) {
+            AVStream *st = in_ctx->streams[sid];
+            int64_t ts = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+
+            ret = av_seek_frame(in_ctx, sid, ts, AVSEEK_FLAG_BACKWARD);
+            if (ret < 0)
+                ret = av_seek_frame(in_ctx, sid, 0, AVSEEK_FLAG_BYTE);
+            if (ret < 0) {
+                fprintf(stderr, "Error seeking to the start of the input (%s)\n",
+                        av_err2str(ret));
+                return ret;
+            }
+
+            /* Do not spin forever on a file with no packets in the stream */
+            rewound = 1;
+            continue;
+        } else if (ret < 0) {
+            return ret;
+        }
+
+        if (pkt->stream_index == sid)
+            return 0;
+
+        av_packet_unref(pkt);
+    }
+}
+
+/* Heap allocations made by a stream's own threads while it measures.
+ * av_malloc() and everything built on it allocates with posix_memalign(),
+ * which is interposed below to count them. */
+typedef struct AllocStats {
+    const atomic_int *measuring;
+    atomic_llong nb_allocs;
+    atomic_llong bytes;
+} AllocStats;
+
+/* Set by each thread a stream runs, NULL in threads that are not counted */
+static _Thread_local AllocStats *thread_allocs;
+
+static int (*real_posix_memalign)(void **ptr, size_t align, size_t size);
+static pthread_once_t real_posix_memalign_once = PTHREAD_ONCE_INIT;
+
+static void find_posix_memalign(void)
+{
+    *(void **)&real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+}
+
+/* Takes the place of libc's, for the FFmpeg libraries too */
+int posix_memalign(void **ptr, size_t align, size_t size)
+{
+    AllocStats *st = thread_allocs;
+
+    pthread_once(&real_posix_memalign_once, find_posix_memalign);
+    if (!real_posix_memalign)
+        return ENOMEM;
+
+    if (st && atomic_load_explicit(st->measuring, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&st->nb_allocs, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&st->bytes, size, memory_order_relaxed);
+    }
+
+    return real_posix_memalign(ptr, align, size);
+}
+
+/* How the demuxer reads the input: through FFmpeg's own file I/O, straight
+ * out of a mapping of the whole file, or from a ring buffer a thread of its
+ * own reads ahead into */
+enum InputIOMode {
+    INPUT_IO_DEFAULT,
+    INPUT_IO_MMAP,
+    INPUT_IO_READAHEAD,
+};
+
+static const char *const input_io_names[] = {
+    [INPUT_IO_DEFAULT]   = "default",
+    [INPUT_IO_MMAP]      = "mmap",
+    [INPUT_IO_READAHEAD] = "readahead",
+};
+
+#define INPUT_BUFFER_SIZE (1 << 20)
+#define READAHEAD_CHUNK (4 << 20)
+
+/* Only counted while measuring */
+typedef struct InputIOStats {
+    int64_t bytes_read;    /* Bytes handed to the demuxer */
+    int64_t read_time;     /* Time spent in the read callback */
+    int64_t wait_time;     /* Time the demuxer waited for the read-ahead */
+    int64_t storage_bytes; /* Bytes the read-ahead thread read */
+    int64_t storage_time;  /* Time it spent reading them */
+} InputIOStats;
+
+typedef struct InputIO {
+    enum InputIOMode mode;
+    AVIOContext *pb;
+    int fd;
+    int64_t size;
+    int64_t pos; /* Of the next read */
+
+    uint8_t *map; /* mmap only */
+
+    /* Read-ahead only. The ring holds the input from pos to fill_pos, and
+     * the byte at offset x of the input is at ring[x % ring_size]. */
+    uint8_t *ring;
+    size_t ring_size;
+    int64_t fill_pos;
+    int gen; /* Bumped when seeking drops what was read ahead */
+    int eof;
+    int err;
+    int stop;
+    pthread_t thread;
+    int running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    const atomic_int *measuring;
+    InputIOStats stats;
+} InputIO;
+
+static void *readahead_thread(void *arg)
+{
+    InputIO *io = arg;
+
+    pthread_mutex_lock(&io->lock);
+    while (!io->stop) {
+        size_t space = io->ring_size - (io->fill_pos - io->pos);
+        if (!space || io->eof || io->err) {
+            pthread_cond_wait(&io->cond, &io->lock);
+            continue;
+        }
+
+        /* Only the free part of the ring is written into, which the
+         * demuxer never reads from, so the lock is not needed meanwhile */
+        int64_t fill_pos = io->fill_pos;
+        size_t off = fill_pos % io->ring_size;
+        size_t len = FFMIN(FFMIN(space, io->ring_size - off), READAHEAD_CHUNK);
+        int gen = io->gen;
+        pthread_mutex_unlock(&io->lock);
+
+        int64_t start = av_gettime_relative();
+        ssize_t ret = pread(io->fd, io->ring + off, len, fill_pos);
+        int err = ret < 0 ? AVERROR(errno) : 0;
+        int64_t time = av_gettime_relative() - start;
+
+        pthread_mutex_lock(&io->lock);
+        /* Seeking elsewhere meanwhile made this read useless */
+        if (gen != io->gen)
+            continue;
+
+        if (err < 0) {
+            io->err = err;
+        } else if (!ret) {
+            io->eof = 1;
+        } else {
+            io->fill_pos += ret;
+            if (atomic_load_explicit(io->measuring, memory_order_relaxed)) {
+                io->stats.storage_bytes += ret;
+                io->stats.storage_time += time;
+            }
+        }
+        pthread_cond_broadcast(&io->cond);
+    }
+    pthread_mutex_unlock(&io->lock);
+
+    return NULL;
+}
+
+static int readahead_read(InputIO *io, uint8_t *buf, int size)
+{
+    int64_t wait_start = 0;
+    int ret;
+
+    pthread_mutex_lock(&io->lock);
+    while (io->fill_pos == io->pos && !io->eof && !io->err) {
+        if (!wait_start)
+            wait_start = av_gettime_relative();
+        pthread_cond_wait(&io->cond, &io->lock);
+    }
+    if (wait_start && atomic_load_explicit(io->measuring, memory_order_relaxed))
+        io->stats.wait_time += av_gettime_relative() - wait_start;
+
+    ret = FFMIN(size, io->fill_pos - io->pos);
+    if (!ret) {
+        ret = io->err ? io->err : AVERROR_EOF;
+    } else {
+        size_t off = io->pos % io->ring_size;
+        size_t len = FFMIN(ret, io->ring_size - off);
+        memcpy(buf, io->ring + off, len);
+        memcpy(buf + len, io->ring, ret - len);
+        io->pos += ret;
+        pthread_cond_broadcast(&io->cond);
+    }
+    pthread_mutex_unlock(&io->lock);
+
+    return ret;
+}
+
+static int input_read_cb(void *opaque, uint8_t *buf, int size)
+{
+    InputIO *io = opaque;
+    int64_t start = av_gettime_relative();
+    int ret;
+
+    if (io->mode == INPUT_IO_MMAP) {
+        ret = FFMIN(size, io->size - io->pos);
+        if (ret <= 0)
+            return AVERROR_EOF;
+        memcpy(buf, io->map + io->pos, ret);
+        io->pos += ret;
+    } else {
+        ret = readahead_read(io, buf, size);
+    }
+
+    if (ret > 0 && atomic_load_explicit(io->measuring, memory_order_relaxed)) {
+        io->stats.bytes_read += ret;
+        io->stats.read_time += av_gettime_relative() - start;
+    }
+
+    return ret;
+}
+
+static int64_t input_seek_cb(void *opaque, int64_t offset, int whence)
+{
+    InputIO *io = opaque;
+
+    if (whence == AVSEEK_SIZE)
+        return io->size;
+
+    whence &= ~AVSEEK_FORCE;
+    if (whence == SEEK_CUR)
+        offset += io->pos;
+    else if (whence == SEEK_END)
+        offset += io->size;
+    else if (whence != SEEK_SET)
+        return AVERROR(EINVAL);
+    if (offset < 0)
+        return AVERROR(EINVAL);
+
+    if (io->mode == INPUT_IO_MMAP) {
+        io->pos = offset;
+        return offset;
+    }
+
+    /* Seeking forward within what was read ahead keeps it */
+    pthread_mutex_lock(&io->lock);
+    if (offset < io->pos || offset > io->fill_pos) {
+        io->fill_pos = offset;
+        io->gen++;
+        io->eof = 0;
+        io->err = 0;
+    }
+    io->pos = offset;
+    pthread_cond_broadcast(&io->cond);
+    pthread_mutex_unlock(&io->lock);
+
+    return offset;
+}
+
+/* Opens path for the demuxer to read through io->pb. ring_size is that of
+ * the read-ahead ring buffer. */
+static int input_io_open(InputIO *io, const char *path, enum InputIOMode mode,
+                         size_t ring_size, const atomic_int *measuring)
+{
+    int err;
+    struct stat st;
+    uint8_t *buf;
+
+    io->mode = mode;
+    io->measuring = measuring;
+
+    io->fd = open(path, O_RDONLY);
+    if (io->fd < 0 || fstat(io->fd, &st) < 0) {
+        err = AVERROR(errno);
+        printf("Error opening %s: %s\n", path, av_err2str(err));
+        return err;
+    }
+    io->size = st.st_size;
+
+    if (mode == INPUT_IO_MMAP) {
+        io->map = mmap(NULL, io->size, PROT_READ, MAP_PRIVATE, io->fd, 0);
+        if (io->map == MAP_FAILED) {
+            err = AVERROR(errno);
+            io->map = NULL;
+            printf("Error mapping %s: %s\n", path, av_err2str(err));
+            return err;
+        }
+        madvise(io->map, io->size, MADV_SEQUENTIAL);
+    } else {
+        io->ring_size = ring_size;
+        io->ring = av_malloc(ring_size);
+        if (!io->ring)
+            return AVERROR(ENOMEM);
+
+        pthread_mutex_init(&io->lock, NULL);
+        pthread_cond_init(&io->cond, NULL);
+        err = pthread_create(&io->thread, NULL, readahead_thread, io);
+        if (err) {
+            pthread_mutex_destroy(&io->lock);
+            pthread_cond_destroy(&io->cond);
+            return AVERROR(err);
+        }
+        io->running = 1;
+    }
+
+    buf = av_malloc(INPUT_BUFFER_SIZE);
+    if (!buf)
+        return AVERROR(ENOMEM);
+
+    io->pb = avio_alloc_context(buf, INPUT_BUFFER_SIZE, 0, io, input_read_cb,
+                                NULL, input_seek_cb);
+    if (!io->pb) {
+        av_free(buf);
+        return AVERROR(ENOMEM);
+    }
+
+    return 0;
+}
+
+/* Must only be called once the demuxer is closed */
+static void input_io_close(InputIO *io)
+{
+    if (io->running) {
+        pthread_mutex_lock(&io->lock);
+        io->stop = 1;
+        pthread_cond_broadcast(&io->cond);
+        pthread_mutex_unlock(&io->lock);
+        pthread_join(io->thread, NULL);
+        pthread_mutex_destroy(&io->lock);
+        pthread_cond_destroy(&io->cond);
+        io->running = 0;
+    }
+
+    if (io->pb)
+        av_freep(&io->pb->buffer);
+    avio_context_free(&io->pb);
+    av_freep(&io->ring);
+    if (io->map)
+        munmap(io->map, io->size);
+    io->map = NULL;
+    if (io->fd >= 0)
+        close(io->fd);
+    io->fd = -1;
+}
+
+typedef struct InputContext {
+    AVFormatContext *fmt_ctx;
+    InputIO io;
+    AVCodecContext *dec;
+    int sid;
+    int demux;
+    int loop;
+
+    AVPacket *pkt;
+    int pkt_pending; /* pkt has not been accepted by the decoder yet */
+    int eof;         /* No more packets to read */
+    int flushed;     /* The decoder has been told to drain */
+
+    /* With -latency, buffers holding the time each packet was read, which
+     * the decoder copies over to its frames */
+    AVBufferPool *stamps;
+} InputContext;
+
+/* Replaces *ref with a stamp of the current time */
+static int stamp_now(AVBufferPool *pool, AVBufferRef **ref)
+{
+    AVBufferRef *buf = av_buffer_pool_get(pool);
+    if (!buf)
+        return AVERROR(ENOMEM);
+
+    *(int64_t *)buf->data = av_gettime_relative();
+    av_buffer_unref(ref);
+    *ref = buf;
+
+    return 0;
+}
+
+/* Returns the next decoded frame, feeding the decoder with as many packets
+ * as it accepts beforehand. When not demuxing, the probe packet in pkt stays
+ * pending forever and is submitted again each time. Returns AVERROR_EOF once
+ * the decoder has been fully drained. */
+static int decode_frame(InputContext *in, AVFrame *frame)
+{
+    int ret;
+
+    for (;;) {
+        while (!in->flushed) {
+            if (!in->pkt_pending && !in->eof) {
+                ret = read_packet(in->fmt_ctx, in->sid, in->loop, in->pkt);
+                if (ret == AVERROR_EOF)
+                    in->eof = 1;
+                else if (ret < 0)
+                    return ret;
+                else
+                    in->pkt_pending = 1;
+            }
+
+            /* Demuxed packets are stamped once read, and the repeated one
+             * each time it is sent again */
+            if (in->stamps && !in->eof && !in->pkt->opaque_ref) {
+                ret = stamp_now(in->stamps, &in->pkt->opaque_ref);
+                if (ret < 0)
+                    return ret;
+            }
+
+            ret = avcodec_send_packet(in->dec, in->eof ? NULL : in->pkt);
+            if (ret == AVERROR(EAGAIN))
+                break;
+            if (ret < 0) {
+                fprintf(stderr, "Error submitting a packet for decoding (%s)\n",
+                        av_err2str(ret));
+                return ret;
+            }
+
+            if (in->eof) {
+                in->flushed = 1;
+            } else if (in->demux) {
+                av_packet_unref(in->pkt);
+                in->pkt_pending = 0;
+            } else {
+                av_buffer_unref(&in->pkt->opaque_ref);
+            }
+        }
+
+        ret = avcodec_receive_frame(in->dec, frame);
+        if (ret != AVERROR(EAGAIN) || in->flushed)
+            return ret;
+    }
+}
+
+/* Muxes the encoded packets into a file from a thread of its own, through
+ * a large buffer written out with plain write() calls */
+#define OUTPUT_BUFFER_SIZE (4 << 20)
+#define OUTPUT_QUEUE 64
+
+typedef struct OutputContext {
+    AVFormatContext *mux;
+    AVStream *st;
+    AVRational time_base; /* Of the packets as they are output */
+    int fd;
+    int64_t nb_packets;
+
+    AVThreadMessageQueue *queue;
+    pthread_t thread;
+    int writing;
+
+    int64_t write_time; /* Time spent in av_write_frame() */
+    int64_t nb_written;
+    AllocStats *allocs; /* Of the stream writing */
+} OutputContext;
+
+static int output_write_cb(void *opaque, const uint8_t *buf, int size)
+{
+    OutputContext *out = opaque;
+    int left = size;
+
+    while (left) {
+        ssize_t ret = write(out->fd, buf, left);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return AVERROR(errno);
+        buf += ret;
+        left -= ret;
+    }
+
+    return size;
+}
+
+static int64_t output_seek_cb(void *opaque, int64_t offset, int whence)
+{
+    OutputContext *out = opaque;
+    int64_t ret;
+
+    if (whence == AVSEEK_SIZE) {
+        struct stat st;
+        return fstat(out->fd, &st) < 0 ? AVERROR(errno) : st.st_size;
+    }
+
+    ret = lseek(out->fd, offset, whence & ~AVSEEK_FORCE);
+    return ret < 0 ? AVERROR(errno) : ret;
+}
+
+/* Opens path for muxing the packets of enc into, in the given format, or
+ * the one guessed from the file name. Packets are timed at frame_rate. */
+static int output_open(OutputContext *out, const char *path, const char *format,
+                       const AVCodecContext *enc, AVRational frame_rate)
+{
+    int err;
+    uint8_t *buf;
+
+    out->fd = -1;
+
+    err = avformat_alloc_output_context2(&out->mux, NULL, format, path);
+    if (err < 0) {
+        printf("Error creating muxer for %s: %s\n", path, av_err2str(err));
+        return err;
+    }
+
+    out->st = avformat_new_stream(out->mux, NULL);
+    if (!out->st)
+        return AVERROR(ENOMEM);
+
+    err = avcodec_parameters_from_context(out->st->codecpar, enc);
+    if (err < 0)
+        return err;
+
+    out->time_base = av_inv_q(frame_rate);
+    out->st->time_base = out->time_base;
+
+    out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out->fd < 0) {
+        err = AVERROR(errno);
+        printf("Error opening %s: %s\n", path, av_err2str(err));
+        return err;
+    }
+
+    buf = av_malloc(OUTPUT_BUFFER_SIZE);
+    if (!buf)
+        return AVERROR(ENOMEM);
+
+    out->mux->pb = avio_alloc_context(buf, OUTPUT_BUFFER_SIZE, 1, out, NULL,
+                                      output_write_cb, output_seek_cb);
+    if (!out->mux->pb) {
+        av_free(buf);
+        return AVERROR(ENOMEM);
+    }
+    out->mux->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    err = avformat_write_header(out->mux, NULL);
+    if (err < 0) {
+        printf("Error writing header to %s: %s\n", path, av_err2str(err));
+        return err;
+    }
+
+    return 0;
+}
+
+static void *output_thread(void *arg)
+{
+    OutputContext *out = arg;
+    AVPacket *pkt;
+    int err;
+
+    thread_allocs = out->allocs;
+
+    for (;;) {
+        err = av_thread_message_queue_recv(out->queue, &pkt, 0);
+        if (err < 0)
+            break;
+
+        int64_t start = av_gettime_relative();
+        err = av_write_frame(out->mux, pkt);
+        out->write_time += av_gettime_relative() - start;
+        out->nb_written++;
+        av_packet_free(&pkt);
+        if (err < 0) {
+            printf("Error writing packet: %s\n", av_err2str(err));
+            break;
+        }
+    }
+
+    av_thread_message_queue_set_err_send(out->queue, err);
+
+    return (void *)(intptr_t)err;
+}
+
+static void free_queued_packet(void *msg)
+{
+    av_packet_free((AVPacket **)msg);
+}
+
+static int output_start(OutputContext *out)
+{
+    int err;
+
+    if (!out->mux)
+        return 0;
+
+    err = av_thread_message_queue_alloc(&out->queue, OUTPUT_QUEUE,
+                                        sizeof(AVPacket *));
+    if (err < 0)
+        return err;
+    av_thread_message_queue_set_free_func(out->queue, free_queued_packet);
+
+    err = pthread_create(&out->thread, NULL, output_thread, out);
+    if (err) {
+        err = AVERROR(err);
+        printf("Error creating thread: %s\n", av_err2str(err));
+        return err;
+    }
+    out->writing = 1;
+
+    return 0;
+}
+
+/* Hands a packet over to the writer, which takes its reference. Its
+ * timestamps are in time_base, and get offset frames added. */
+static int output_write(OutputContext *out, AVPacket *pkt,
+                        AVRational time_base, int64_t offset)
+{
+    int err;
+    AVPacket *queued = av_packet_alloc();
+    if (!queued)
+        return AVERROR(ENOMEM);
+
+    av_packet_move_ref(queued, pkt);
+    queued->stream_index = 0;
+    if (queued->pts == AV_NOPTS_VALUE || queued->dts == AV_NOPTS_VALUE) {
+        /* Consecutive timestamps, for encoders which do not give any */
+        queued->pts = queued->dts = out->nb_packets;
+    } else {
+        av_packet_rescale_ts(queued, time_base, out->time_base);
+        queued->pts += offset;
+        queued->dts += offset;
+    }
+    out->nb_packets++;
+    queued->duration = 1;
+    av_packet_rescale_ts(queued, out->time_base, out->st->time_base);
+
+    err = av_thread_message_queue_send(out->queue, &queued, 0);
+    if (err < 0)
+        av_packet_free(&queued);
+
+    return err;
+}
+
+/* Waits for all packets to be written, then finishes the file */
+static int output_stop(OutputContext *out)
+{
+    int err = 0;
+    void *ret;
+
+    if (!out->writing)
+        return 0;
+
+    av_thread_message_queue_set_err_recv(out->queue, AVERROR_EOF);
+    pthread_join(out->thread, &ret);
+    out->writing = 0;
+    av_thread_message_queue_free(&out->queue);
+
+    if ((intptr_t)ret != AVERROR_EOF)
+        return (intptr_t)ret;
+
+    err = av_write_trailer(out->mux);
+    if (err < 0)
+        printf("Error finishing the output: %s\n", av_err2str(err));
+    avio_flush(out->mux->pb);
+
+    return err;
+}
+
+static void output_close(OutputContext *out)
+{
+    if (out->mux) {
+        if (out->mux->pb)
+            av_freep(&out->mux->pb->buffer);
+        avio_context_free(&out->mux->pb);
+        avformat_free_context(out->mux);
+        out->mux = NULL;
+    }
+    if (out->fd >= 0)
+        close(out->fd);
+    out->fd = -1;
+}
+
+/* How frames get from the decoded format to the encoder's, cheapest first */
+enum ConvPath {
+    CONV_NONE,   /* Encoded as decoded */
+    CONV_REPACK, /* The same samples, laid out differently */
+    CONV_FULL,   /* Resampled chroma, or changed depth or color model */
+};
+
+static const char *const conv_names[] = {
+    [CONV_NONE]   = "none",
+    [CONV_REPACK] = "repack",
+    [CONV_FULL]   = "conversion",
+};
+
+/* Formats FFV1 on Vulkan does not take, and the repack it takes instead */
+static const struct {
+    enum AVPixelFormat from, to;
+} ffv1_repacks[] = {
+    { AV_PIX_FMT_YUV420P, AV_PIX_FMT_NV12    },
+    { AV_PIX_FMT_GBRAP16, AV_PIX_FMT_RGBA64  },
+    { AV_PIX_FMT_GBRP10,  AV_PIX_FMT_X2BGR10 },
+    { AV_PIX_FMT_RGB48LE, AV_PIX_FMT_GBRP16  },
+    { AV_PIX_FMT_RGB48BE, AV_PIX_FMT_GBRP16  },
+    { AV_PIX_FMT_BGR0,    AV_PIX_FMT_RGB0    },
+};
+
+static enum AVPixelFormat ffv1_repack(enum AVPixelFormat fmt)
+{
+    for (int i = 0; i < FF_ARRAY_ELEMS(ffv1_repacks); i++)
+        if (ffv1_repacks[i].from == fmt)
+            return ffv1_repacks[i].to;
+    return AV_PIX_FMT_NONE;
+}
+
+/* Whether a and b hold the same samples: same color model, components,
+ * depths and chroma subsampling */
+static int is_repack(enum AVPixelFormat a, enum AVPixelFormat b)
+{
+    const AVPixFmtDescriptor *da = av_pix_fmt_desc_get(a);
+    const AVPixFmtDescriptor *db = av_pix_fmt_desc_get(b);
+
+    if (!da || !db || da->nb_components != db->nb_components ||
+        (da->flags & AV_PIX_FMT_FLAG_RGB) != (db->flags & AV_PIX_FMT_FLAG_RGB) ||
+        da->log2_chroma_w != db->log2_chroma_w ||
+        da->log2_chroma_h != db->log2_chroma_h)
+        return 0;
+
+    for (int i = 0; i < da->nb_components; i++)
+        if (da->comp[i].depth != db->comp[i].depth)
+            return 0;
+
+    return 1;
+}
+
+/* Whether the encoder takes frames in fmt. fmts is the list a software
+ * encoder gives, if any. */
+static int encoder_takes(const AVCodec *codec, int vulkan,
+                         const enum AVPixelFormat *fmts, enum AVPixelFormat fmt)
+{
+    if (vulkan) {
+        if (codec->id == AV_CODEC_ID_FFV1)
+            return ffv1_repack(fmt) == AV_PIX_FMT_NONE;
+
+        /* Video encoders only take semi-planar 4:2:0 */
+        return fmt == AV_PIX_FMT_NV12 || fmt == AV_PIX_FMT_P010;
+    }
+
+    if (!fmts)
+        return 1;
+    for (; *fmts != AV_PIX_FMT_NONE; fmts++)
+        if (*fmts == fmt)
+            return 1;
+    return 0;
+}
+
+/* Picks the format the encoder gets frames in, from the decoded one: out of
+ * those the device takes for Vulkan encoders, or the encoder lists for
+ * software ones, the decoded format itself, then a repack, then the least
+ * lossy conversion. Returns AV_PIX_FMT_NONE if there is none. */
+static enum AVPixelFormat negotiate_format(const AVCodec *codec, int vulkan,
+                                           AVBufferRef *hw_dev_ref,
+                                           enum AVPixelFormat fmt,
+                                           enum ConvPath *path)
+{
+    AVHWFramesConstraints *cst = NULL;
+    const enum AVPixelFormat *enc_fmts = NULL, *fmts;
+    enum AVPixelFormat *cands, ret = AV_PIX_FMT_NONE;
+    enum AVPixelFormat repack = ffv1_repack(fmt);
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+    int alpha = !!(desc->flags & AV_PIX_FMT_FLAG_ALPHA);
+    int nb_fmts = 0, nb = 0, nb_repacks = 0;
+
+    if (!vulkan && avcodec_get_supported_config(NULL, codec,
+                                                AV_CODEC_CONFIG_PIX_FORMAT, 0,
+                                                (const void **)&enc_fmts, NULL) < 0)
+        enc_fmts = NULL;
+
+    /* Without a list to pick from, only the likely candidates are tried */
+    const enum AVPixelFormat fallback[] = {
+        fmt, AV_PIX_FMT_NV12, AV_PIX_FMT_P010, repack, AV_PIX_FMT_NONE
+    };
+    if (vulkan) {
+        cst = av_hwdevice_get_hwframe_constraints(hw_dev_ref, NULL);
+        fmts = cst && cst->valid_sw_formats ? cst->valid_sw_formats : fallback;
+    } else {
+        fmts = enc_fmts ? enc_fmts : fallback;
+    }
+
+    while (fmts[nb_fmts] != AV_PIX_FMT_NONE)
+        nb_fmts++;
+    cands = av_malloc_array(nb_fmts + 1, sizeof(*cands));
+    if (!cands)
+        goto end;
+
+    /* The formats the encoder takes, repacks of fmt first */
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < nb_fmts; i++)
+            if (is_repack(fmts[i], fmt) == !pass &&
+                encoder_takes(codec, vulkan, enc_fmts, fmts[i]))
+                cands[nb++] = fmts[i];
+        if (!pass)
+            nb_repacks = nb;
+    }
+    cands[nb] = AV_PIX_FMT_NONE;
+
+    for (int i = 0; i < nb_repacks; i++) {
+        if (cands[i] == fmt) {
+            ret = fmt;
+            *path = CONV_NONE;
+            goto end;
+        }
+        if (cands[i] == repack)
+            ret = repack;
+    }
+
+    *path = CONV_REPACK;
+    if (ret == AV_PIX_FMT_NONE && nb_repacks) {
+        enum AVPixelFormat next = cands[nb_repacks];
+        cands[nb_repacks] = AV_PIX_FMT_NONE;
+        ret = avcodec_find_best_pix_fmt_of_list(cands, fmt, alpha, NULL);
+        cands[nb_repacks] = next;
+    } else if (ret == AV_PIX_FMT_NONE && nb) {
+        ret = avcodec_find_best_pix_fmt_of_list(cands, fmt, alpha, NULL);
+        *path = CONV_FULL;
+    }
+
+end:
+    if (ret == AV_PIX_FMT_NONE)
+        printf("No format to encode %s frames in with %s\n",
+               av_get_pix_fmt_name(fmt), codec->name);
+    av_free(cands);
+    av_hwframe_constraints_free(&cst);
+    return ret;
+}
+
+/* Whether the encoder takes Vulkan frames, rather than software ones */
+static int encoder_is_vulkan(const AVCodec *codec)
+{
+    const enum AVPixelFormat *fmts = NULL;
+
+    if (avcodec_get_supported_config(NULL, codec, AV_CODEC_CONFIG_PIX_FORMAT,
+                                     0, (const void **)&fmts, NULL) < 0 || !fmts)
+        return 0;
+
+    for (; *fmts != AV_PIX_FMT_NONE; fmts++)
+        if (*fmts == AV_PIX_FMT_VULKAN)
+            return 1;
+
+    return 0;
+}
+
+/* Repacks: the samples stay the same, only their layout changes, so these
+ * are done with dedicated kernels rather than swscale. Rows are processed
+ * by the functions of a RepackDSP, picked at runtime for the CPU. */
+typedef struct RepackDSP {
+    const char *name;
+    /* dst[2i] = a[i], dst[2i + 1] = b[i] */
+    void (*interleave_u8)(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n);
+    /* Swaps bytes 0 and 2 of n 4-byte pixels */
+    void (*swap_rb_u8x4)(uint8_t *dst, const uint8_t *src, int n);
+    /* dst[4i + j] = {a, b, c, d}[j][i] */
+    void (*interleave_u16x4)(uint16_t *dst, const uint16_t *a, const uint16_t *b,
+                             const uint16_t *c, const uint16_t *d, int n);
+    /* dst[i] = r[i] | g[i] << 10 | b[i] << 20 */
+    void (*pack_x2bgr10)(uint32_t *dst, const uint16_t *r, const uint16_t *g,
+                         const uint16_t *b, int n);
+    /* {a, b, c}[j][i] = src[3i + j], byte swapped if bswap is set */
+    void (*deinterleave_u16x3)(uint16_t *a, uint16_t *b, uint16_t *c,
+                               const uint16_t *src, int n, int bswap);
+} RepackDSP;
+
+static void interleave_u8_c(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n)
+{
+    for (int i = 0; i < n; i++) {
+        dst[2*i + 0] = a[i];
+        dst[2*i + 1] = b[i];
+    }
+}
+
+static void swap_rb_u8x4_c(uint8_t *dst, const uint8_t *src, int n)
+{
+    for (int i = 0; i < n; i++) {
+        dst[4*i + 0] = src[4*i + 2];
+        dst[4*i + 1] = src[4*i + 1];
+        dst[4*i + 2] = src[4*i + 0];
+        dst[4*i + 3] = src[4*i + 3];
+    }
+}
+
+static void interleave_u16x4_c(uint16_t *dst, const uint16_t *a, const uint16_t *b,
+                               const uint16_t *c, const uint16_t *d, int n)
+{
+    for (int i = 0; i < n; i++) {
+        dst[4*i + 0] = a[i];
+        dst[4*i + 1] = b[i];
+        dst[4*i + 2] = c[i];
+        dst[4*i + 3] = d[i];
+    }
+}
+
+static void pack_x2bgr10_c(uint32_t *dst, const uint16_t *r, const uint16_t *g,
+                           const uint16_t *b, int n)
+{
+    for (int i = 0; i < n; i++)
+        dst[i] = r[i] | (uint32_t)g[i] << 10 | (uint32_t)b[i] << 20;
+}
+
+static void deinterleave_u16x3_c(uint16_t *a, uint16_t *b, uint16_t *c,
+                                 const uint16_t *src, int n, int bswap)
+{
+    if (bswap) {
+        for (int i = 0; i < n; i++) {
+            a[i] = av_bswap16(src[3*i + 0]);
+            b[i] = av_bswap16(src[3*i + 1]);
+            c[i] = av_bswap16(src[3*i + 2]);
+        }
+    } else {
+        for (int i = 0; i < n; i++) {
+            a[i] = src[3*i + 0];
+            b[i] = src[3*i + 1];
+            c[i] = src[3*i + 2];
+        }
+    }
+}
+
+/* The SIMD versions do as many pixels as fit in whole vectors, and leave the
+ * rest of the row to the C ones */
+#if HAVE_REPACK_AVX2
+#define AVX2 __attribute__((target("avx2")))
+
+static AVX2 void interleave_u8_avx2(uint8_t *dst, const uint8_t *a,
+                                    const uint8_t *b, int n)
+{
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        /* Unpacking works within 128-bit lanes, hence the permutes */
+        __m256i lo = _mm256_unpacklo_epi8(va, vb);
+        __m256i hi = _mm256_unpackhi_epi8(va, vb);
+        _mm256_storeu_si256((__m256i *)(dst + 2*i),
+                            _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + 2*i + 32),
+                            _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    interleave_u8_c(dst + 2*i, a + i, b + i, n - i);
+}
+
+static AVX2 void swap_rb_u8x4_avx2(uint8_t *dst, const uint8_t *src, int n)
+{
+    const __m256i shuf = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                          10, 9, 8, 11, 14, 13, 12, 15,
+                                          2, 1, 0, 3, 6, 5, 4, 7,
+                                          10, 9, 8, 11, 14, 13, 12, 15);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + 4*i));
+        _mm256_storeu_si256((__m256i *)(dst + 4*i), _mm256_shuffle_epi8(v, shuf));
+    }
+    swap_rb_u8x4_c(dst + 4*i, src + 4*i, n - i);
+}
+
+static AVX2 void interleave_u16x4_avx2(uint16_t *dst, const uint16_t *a,
+                                       const uint16_t *b, const uint16_t *c,
+                                       const uint16_t *d, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i vc = _mm256_loadu_si256((const __m256i *)(c + i));
+        __m256i vd = _mm256_loadu_si256((const __m256i *)(d + i));
+        __m256i ab_lo = _mm256_unpacklo_epi16(va, vb);
+        __m256i ab_hi = _mm256_unpackhi_epi16(va, vb);
+        __m256i cd_lo = _mm256_unpacklo_epi16(vc, vd);
+        __m256i cd_hi = _mm256_unpackhi_epi16(vc, vd);
+        /* Pixels 0-1 and 8-9, 2-3 and 10-11, 4-5 and 12-13, 6-7 and 14-15 */
+        __m256i p0 = _mm256_unpacklo_epi32(ab_lo, cd_lo);
+        __m256i p1 = _mm256_unpackhi_epi32(ab_lo, cd_lo);
+        __m256i p2 = _mm256_unpacklo_epi32(ab_hi, cd_hi);
+        __m256i p3 = _mm256_unpackhi_epi32(ab_hi, cd_hi);
+        __m256i *out = (__m256i *)(dst + 4*i);
+        _mm256_storeu_si256(out + 0, _mm256_permute2x128_si256(p0, p1, 0x20));
+        _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(p2, p3, 0x20));
+        _mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(p0, p1, 0x31));
+        _mm256_storeu_si256(out + 3, _mm256_permute2x128_si256(p2, p3, 0x31));
+    }
+    interleave_u16x4_c(dst + 4*i, a + i, b + i, c + i, d + i, n - i);
+}
+
+static AVX2 void pack_x2bgr10_avx2(uint32_t *dst, const uint16_t *r,
+                                   const uint16_t *g, const uint16_t *b, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i vr = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(r + i)));
+        __m256i vg = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(g + i)));
+        __m256i vb = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(b + i)));
+        __m256i v = _mm256_or_si256(vr, _mm256_or_si256(_mm256_slli_epi32(vg, 10),
+                                                        _mm256_slli_epi32(vb, 20)));
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+    }
+    pack_x2bgr10_c(dst + i, r + i, g + i, b + i, n - i);
+}
+
+/* 8 pixels are 3 vectors of 8 words. Each output gathers its words from
+ * all 3 with byte shuffles, which also do the byte swapping if needed. */
+static AVX2 void deinterleave_u16x3_avx2(uint16_t *a, uint16_t *b, uint16_t *c,
+                                         const uint16_t *src, int n, int bswap)
+{
+    uint16_t *const dst[3] = { a, b, c };
+    __m128i mask[3][3]; /* By output, then input vector */
+    int i = 0;
+
+    for (int j = 0; j < 3; j++) {
+        for (int v = 0; v < 3; v++) {
+            uint8_t m[16];
+            for (int k = 0; k < 8; k++) {
+                int w = 3*k + j - 8*v; /* Word of input v output word k is */
+                int in = w >= 0 && w < 8;
+                m[2*k + 0] = in ? 2*w + bswap  : 0x80;
+                m[2*k + 1] = in ? 2*w + !bswap : 0x80;
+            }
+            mask[j][v] = _mm_loadu_si128((const __m128i *)m);
+        }
+    }
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(src + 3*i));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(src + 3*i + 8));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(src + 3*i + 16));
+        for (int j = 0; j < 3; j++) {
+            __m128i v = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, mask[j][0]),
+                                                  _mm_shuffle_epi8(v1, mask[j][1])),
+                                     _mm_shuffle_epi8(v2, mask[j][2]));
+            _mm_storeu_si128((__m128i *)(dst[j] + i), v);
+        }
+    }
+    deinterleave_u16x3_c(a + i, b + i, c + i, src + 3*i, n - i, bswap);
+}
+#endif
+
+#if HAVE_REPACK_NEON
+static void interleave_u8_neon(uint8_t *dst, const uint8_t *a,
+                               const uint8_t *b, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x2_t v = { { vld1q_u8(a + i), vld1q_u8(b + i) } };
+        vst2q_u8(dst + 2*i, v);
+    }
+    interleave_u8_c(dst + 2*i, a + i, b + i, n - i);
+}
+
+static void swap_rb_u8x4_neon(uint8_t *dst, const uint8_t *src, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x4_t v = vld4q_u8(src + 4*i);
+        uint8x16_t t = v.val[0];
+        v.val[0] = v.val[2];
+        v.val[2] = t;
+        vst4q_u8(dst + 4*i, v);
+    }
+    swap_rb_u8x4_c(dst + 4*i, src + 4*i, n - i);
+}
+
+static void interleave_u16x4_neon(uint16_t *dst, const uint16_t *a,
+                                  const uint16_t *b, const uint16_t *c,
+                                  const uint16_t *d, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint16x8x4_t v = { { vld1q_u16(a + i), vld1q_u16(b + i),
+                             vld1q_u16(c + i), vld1q_u16(d + i) } };
+        vst4q_u16(dst + 4*i, v);
+    }
+    interleave_u16x4_c(dst + 4*i, a + i, b + i, c + i, d + i, n - i);
+}
+
+static void pack_x2bgr10_neon(uint32_t *dst, const uint16_t *r,
+                              const uint16_t *g, const uint16_t *b, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t vr = vld1q_u16(r + i);
+        uint16x8_t vg = vld1q_u16(g + i);
+        uint16x8_t vb = vld1q_u16(b + i);
+        uint32x4_t lo = vorrq_u32(vmovl_u16(vget_low_u16(vr)),
+                                  vorrq_u32(vshlq_n_u32(vmovl_u16(vget_low_u16(vg)), 10),
+                                            vshlq_n_u32(vmovl_u16(vget_low_u16(vb)), 20)));
+        uint32x4_t hi = vorrq_u32(vmovl_u16(vget_high_u16(vr)),
+                                  vorrq_u32(vshlq_n_u32(vmovl_u16(vget_high_u16(vg)), 10),
+                                            vshlq_n_u32(vmovl_u16(vget_high_u16(vb)), 20)));
+        vst1q_u32(dst + i, lo);
+        vst1q_u32(dst + i + 4, hi);
+    }
+    pack_x2bgr10_c(dst + i, r + i, g + i, b + i, n - i);
+}
+
+static void deinterleave_u16x3_neon(uint16_t *a, uint16_t *b, uint16_t *c,
+                                    const uint16_t *src, int n, int bswap)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint16x8x3_t v = vld3q_u16(src + 3*i);
+        if (bswap)
+            for (int j = 0; j < 3; j++)
+                v.val[j] = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(v.val[j])));
+        vst1q_u16(a + i, v.val[0]);
+        vst1q_u16(b + i, v.val[1]);
+        vst1q_u16(c + i, v.val[2]);
+    }
+    deinterleave_u16x3_c(a + i, b + i, c + i, src + 3*i, n - i, bswap);
+}
+#endif
+
+static void repack_dsp_init(RepackDSP *dsp, int cpu_flags)
+{
+    *dsp = (RepackDSP) {
+        .name               = "c",
+        .interleave_u8      = interleave_u8_c,
+        .swap_rb_u8x4       = swap_rb_u8x4_c,
+        .interleave_u16x4   = interleave_u16x4_c,
+        .pack_x2bgr10       = pack_x2bgr10_c,
+        .deinterleave_u16x3 = deinterleave_u16x3_c,
+    };
+
+#if HAVE_REPACK_AVX2
+    if (cpu_flags & AV_CPU_FLAG_AVX2) {
+        dsp->name               = "avx2";
+        dsp->interleave_u8      = interleave_u8_avx2;
+        dsp->swap_rb_u8x4       = swap_rb_u8x4_avx2;
+        dsp->interleave_u16x4   = interleave_u16x4_avx2;
+        dsp->pack_x2bgr10       = pack_x2bgr10_avx2;
+        dsp->deinterleave_u16x3 = deinterleave_u16x3_avx2;
+    }
+#elif HAVE_REPACK_NEON
+    if (cpu_flags & AV_CPU_FLAG_NEON) {
+        dsp->name               = "neon";
+        dsp->interleave_u8      = interleave_u8_neon;
+        dsp->swap_rb_u8x4       = swap_rb_u8x4_neon;
+        dsp->interleave_u16x4   = interleave_u16x4_neon;
+        dsp->pack_x2bgr10       = pack_x2bgr10_neon;
+        dsp->deinterleave_u16x3 = deinterleave_u16x3_neon;
+    }
+#endif
+}
+
+#define ROW(f, p, y) ((f)->data[p] + (ptrdiff_t)(y) * (f)->linesize[p])
+
+/* Repacks rows y0 to y1 of src into dst */
+typedef void (*RepackSliceFunc)(const RepackDSP *dsp, AVFrame *dst,
+                                const AVFrame *src, int y0, int y1);
+
+/* Slices start on even rows, so each chroma row belongs to a single one */
+static void repack_yuv420p_nv12(const RepackDSP *dsp, AVFrame *dst,
+                                const AVFrame *src, int y0, int y1)
+{
+    for (int y = y0; y < y1; y++)
+        memcpy(ROW(dst, 0, y), ROW(src, 0, y), src->width);
+    for (int y = y0 >> 1; y < (y1 + 1) >> 1; y++)
+        dsp->interleave_u8(ROW(dst, 1, y), ROW(src, 1, y), ROW(src, 2, y),
+                           (src->width + 1) >> 1);
+}
+
+static void repack_gbrap16_rgba64(const RepackDSP *dsp, AVFrame *dst,
+                                  const AVFrame *src, int y0, int y1)
+{
+    for (int y = y0; y < y1; y++)
+        dsp->interleave_u16x4((uint16_t *)ROW(dst, 0, y),
+                              (const uint16_t *)ROW(src, 2, y),
+                              (const uint16_t *)ROW(src, 0, y),
+                              (const uint16_t *)ROW(src, 1, y),
+                              (const uint16_t *)ROW(src, 3, y), src->width);
+}
+
+static void repack_gbrp10_x2bgr10(const RepackDSP *dsp, AVFrame *dst,
+                                  const AVFrame *src, int y0, int y1)
+{
+    for (int y = y0; y < y1; y++)
+        dsp->pack_x2bgr10((uint32_t *)ROW(dst, 0, y),
+                          (const uint16_t *)ROW(src, 2, y),
+                          (const uint16_t *)ROW(src, 0, y),
+                          (const uint16_t *)ROW(src, 1, y), src->width);
+}
+
+static void repack_rgb48_gbrp16(const RepackDSP *dsp, AVFrame *dst,
+                                const AVFrame *src, int y0, int y1, int bswap)
+{
+    for (int y = y0; y < y1; y++)
+        dsp->deinterleave_u16x3((uint16_t *)ROW(dst, 2, y),
+                                (uint16_t *)ROW(dst, 0, y),
+                                (uint16_t *)ROW(dst, 1, y),
+                                (const uint16_t *)ROW(src, 0, y), src->width, bswap);
+}
+
+static void repack_rgb48le_gbrp16(const RepackDSP *dsp, AVFrame *dst,
+                                  const AVFrame *src, int y0, int y1)
+{
+    repack_rgb48_gbrp16(dsp, dst, src, y0, y1, 0);
+}
+
+static void repack_rgb48be_gbrp16(const RepackDSP *dsp, AVFrame *dst,
+                                  const AVFrame *src, int y0, int y1)
+{
+    repack_rgb48_gbrp16(dsp, dst, src, y0, y1, 1);
+}
+
+static void repack_bgr0_rgb0(const RepackDSP *dsp, AVFrame *dst,
+                             const AVFrame *src, int y0, int y1)
+{
+    for (int y = y0; y < y1; y++)
+        dsp->swap_rb_u8x4(ROW(dst, 0, y), ROW(src, 0, y), src->width);
+}
+
+/* The repacks of ffv1_repacks[] there is a kernel for. The kernels take the
+ * native endian formats to be little endian. */
+static const struct {
+    enum AVPixelFormat from, to;
+    RepackSliceFunc slice;
+} repack_kernels[] = {
+    { AV_PIX_FMT_YUV420P, AV_PIX_FMT_NV12,    repack_yuv420p_nv12   },
+    { AV_PIX_FMT_GBRAP16, AV_PIX_FMT_RGBA64,  repack_gbrap16_rgba64 },
+    { AV_PIX_FMT_GBRP10,  AV_PIX_FMT_X2BGR10, repack_gbrp10_x2bgr10 },
+    { AV_PIX_FMT_RGB48LE, AV_PIX_FMT_GBRP16,  repack_rgb48le_gbrp16 },
+    { AV_PIX_FMT_RGB48BE, AV_PIX_FMT_GBRP16,  repack_rgb48be_gbrp16 },
+    { AV_PIX_FMT_BGR0,    AV_PIX_FMT_RGB0,    repack_bgr0_rgb0      },
+};
+
+static RepackSliceFunc repack_kernel(enum AVPixelFormat from, enum AVPixelFormat to)
+{
+    if (AV_HAVE_BIGENDIAN)
+        return NULL;
+    for (int i = 0; i < FF_ARRAY_ELEMS(repack_kernels); i++)
+        if (repack_kernels[i].from == from && repack_kernels[i].to == to)
+            return repack_kernels[i].slice;
+    return NULL;
+}
+
+/* Runs a repack kernel over slices of rows, on the calling thread and
+ * nb_threads workers */
+typedef struct RepackContext {
+    RepackSliceFunc slice; /* NULL if frames are converted with swscale */
+    RepackDSP dsp;
+    enum AVPixelFormat from, to;
+
+    pthread_t *threads;
+    int nb_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond; /* Slices to do, or stop */
+    pthread_cond_t done_cond; /* The last slice was done */
+    int stop;
+
+    /* The frame being repacked */
+    AVFrame *dst;
+    const AVFrame *src;
+    int slice_height;
+    int nb_slices;
+    int next_slice;
+    int nb_done;
+} RepackContext;
+
+/* Does slices of the current frame until none are left. Called with the
+ * lock held. */
+static void repack_run_slices(RepackContext *r)
+{
+    while (r->next_slice < r->nb_slices) {
+        int y0 = r->next_slice++ * r->slice_height;
+        int y1 = FFMIN(y0 + r->slice_height, r->src->height);
+
+        pthread_mutex_unlock(&r->lock);
+        r->slice(&r->dsp, r->dst, r->src, y0, y1);
+        pthread_mutex_lock(&r->lock);
+
+        if (++r->nb_done == r->nb_slices)
+            pthread_cond_signal(&r->done_cond);
+    }
+}
+
+static void *repack_thread(void *arg)
+{
+    RepackContext *r = arg;
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->stop) {
+        if (r->next_slice < r->nb_slices)
+            repack_run_slices(r);
+        else
+            pthread_cond_wait(&r->work_cond, &r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    return NULL;
+}
+
+/* Repacks in slices of slice_height rows, or as many slices as threads if
+ * it is 0 */
+static void repack_frame(RepackContext *r, AVFrame *dst, const AVFrame *src,
+                         int slice_height)
+{
+    if (!r->nb_threads) {
+        r->slice(&r->dsp, dst, src, 0, src->height);
+        return;
+    }
+
+    if (!slice_height)
+        slice_height = (src->height + r->nb_threads) / (r->nb_threads + 1);
+
+    pthread_mutex_lock(&r->lock);
+    r->dst = dst;
+    r->src = src;
+    r->slice_height = FFALIGN(slice_height, 2);
+    r->nb_slices = (src->height + r->slice_height - 1) / r->slice_height;
+    r->next_slice = r->nb_done = 0;
+    pthread_cond_broadcast(&r->work_cond);
+
+    repack_run_slices(r);
+    while (r->nb_done < r->nb_slices)
+        pthread_cond_wait(&r->done_cond, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void repack_uninit(RepackContext *r)
+{
+    if (!r->slice)
+        return;
+
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_broadcast(&r->work_cond);
+    pthread_mutex_unlock(&r->lock);
+
+    for (int i = 0; i < r->nb_threads; i++)
+        pthread_join(r->threads[i], NULL);
+    av_freep(&r->threads);
+    pthread_cond_destroy(&r->done_cond);
+    pthread_cond_destroy(&r->work_cond);
+    pthread_mutex_destroy(&r->lock);
+    r->slice = NULL;
+}
+
+/* Sets up repacking from one format to the other over threads in total.
+ * Returns AVERROR(ENOSYS) if there is no kernel for it. */
+static int repack_init(RepackContext *r, enum AVPixelFormat from,
+                       enum AVPixelFormat to, int cpu_flags, int threads)
+{
+    RepackSliceFunc slice = repack_kernel(from, to);
+
+    if (!slice)
+        return AVERROR(ENOSYS);
+
+    *r = (RepackContext) { .from = from, .to = to };
+    repack_dsp_init(&r->dsp, cpu_flags);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->work_cond, NULL);
+    pthread_cond_init(&r->done_cond, NULL);
+    r->slice = slice;
+
+    if (threads > 1) {
+        r->threads = av_calloc(threads - 1, sizeof(*r->threads));
+        if (!r->threads) {
+            repack_uninit(r);
+            return AVERROR(ENOMEM);
+        }
+    }
+    for (int i = 0; i < threads - 1; i++) {
+        int err = pthread_create(&r->threads[i], NULL, repack_thread, r);
+        if (err) {
+            repack_uninit(r);
+            return AVERROR(err);
+        }
+        r->nb_threads++;
+    }
+
+    return 0;
+}
+
+/* What repacks frames on the CPU */
+enum RepackMode {
+    REPACK_AUTO, /* The kernels, with the best SIMD the CPU has */
+    REPACK_C,    /* The kernels, in plain C */
+    REPACK_SWS,  /* swscale, as for any other conversion */
+};
+
+static const char *const repack_names[] = {
+    [REPACK_AUTO] = "auto",
+    [REPACK_C]    = "c",
+    [REPACK_SWS]  = "sws",
+};
+
+/* How software frames get into Vulkan frames */
+enum UploadMode {
+    UPLOAD_COPY,  /* av_hwframe_transfer_data(), after any conversion */
+    UPLOAD_MAP,   /* Decoded, converted or copied into mapped frames */
+    UPLOAD_FUSED, /* As mapped, converting band by band as one stage */
+};
+
+static const char *const upload_names[] = {
+    [UPLOAD_COPY]  = "copy",
+    [UPLOAD_MAP]   = "map",
+    [UPLOAD_FUSED] = "fused",
+};
+
+#define MAX_SWEEP 8
+
+/* An encoder option and the values -sweep gives it */
+typedef struct SweepParam {
+    char *key;
+    char **values;
+    int nb_values;
+} SweepParam;
+
+typedef struct BenchOptions {
+    const char *input;
+    const char *device;
+    int hwdec;
+    int encode;
+
+    int demux; /* Read packets continuously rather than repeating the first */
+    enum InputIOMode input_io;
+    int readahead; /* MiB the read-ahead thread keeps buffered */
+    int loop;  /* Seek back to the start at EOF instead of stopping */
+
+    int dec_threads;          /* 0 for one per CPU, -1 for the libavcodec default */
+    int dec_thread_type;      /* FF_THREAD_* flags, 0 for the libavcodec default */
+    const char *dec_cpus_str; /* CPUs decoder threads are pinned to, if any */
+    cpu_set_t dec_cpus;
+
+    int numa; /* Run each stream on the NUMA node of its device */
+
+    int pipeline;  /* Run decode, convert/upload and encode on their own threads */
+    int dec_queue; /* Frames buffered between the decode and upload stages */
+    int up_queue;  /* Frames buffered between the upload and encode stages */
+
+    int hw_pool; /* Frames in the hardware decoder's pool, 0 for automatic */
+
+    enum UploadMode upload;
+
+    int gpu_convert;        /* Upload the decoded format, convert on the GPU */
+    const char *gpu_filter; /* Filtergraph doing the conversion, if not the default */
+
+    int sws_threads;       /* 0 picks the number of CPUs */
+    const char *sws_flags;
+
+    enum RepackMode repack;
+    int repack_bench; /* Time the repack kernels against swscale first */
+
+    int gpu_timing; /* Time GPU work with timestamp queries */
+
+    const char *json_path;
+    const char *csv_path;
+
+    int progress; /* Milliseconds between progress reports, 0 to disable */
+
+    int frames;       /* Frames to measure, 0 for the default */
+    int warmup;       /* Frames to run before measuring */
+    int64_t duration; /* Microseconds to measure for, rather than a frame count */
+
+    int streams; /* Independent pipelines, 0 for one per device */
+
+    int latency; /* Time each frame from reading its packet to its encoding */
+
+    const char *output;        /* File to mux the packets into, if any */
+    const char *output_format; /* Guessed from the file name if not set */
+
+    int async_depth;  /* Frames each encoder keeps in flight */
+    int enc_parallel; /* Encoders each stream encodes with in parallel */
+    int enc_chunk;    /* Consecutive frames each encoder gets in turn */
+
+    const char *encoder;    /* Vulkan or software encoder */
+
+    int cache;              /* Frames to decode once and loop over, if any */
+    const char *cache_file; /* Raw file to map the cache from instead of RAM */
+    AVDictionary *enc_opts; /* From -encopt, on top of the defaults */
+
+    /* Encoder options to try every combination of values of */
+    SweepParam sweep[MAX_SWEEP];
+    int nb_sweep;
+} BenchOptions;
+
+enum BenchStage {
+    STAGE_DECODE,
+    STAGE_CONVERT,
+    STAGE_HW_ALLOC,
+    STAGE_UPLOAD,
+    STAGE_GPU_CONVERT,
+    STAGE_ENCODE,
+    NB_STAGES,
+};
+
+static const char *const stage_names[NB_STAGES] = {
+    [STAGE_DECODE]      = "decode",
+    [STAGE_CONVERT]     = "convert",
+    [STAGE_HW_ALLOC]    = "hw alloc",
+    [STAGE_UPLOAD]      = "upload",
+    [STAGE_GPU_CONVERT] = "gpu convert",
+    [STAGE_ENCODE]      = "encode",
+};
+
+/* For JSON and CSV output */
+static const char *const stage_keys[NB_STAGES] = {
+    [STAGE_DECODE]      = "decode",
+    [STAGE_CONVERT]     = "convert",
+    [STAGE_HW_ALLOC]    = "hw_alloc",
+    [STAGE_UPLOAD]      = "upload",
+    [STAGE_GPU_CONVERT] = "gpu_convert",
+    [STAGE_ENCODE]      = "encode",
+};
+
+/* Every time a stage took, in microseconds. Each stage is only ever timed
+ * from a single thread. */
+typedef struct StageStats {
+    int64_t *samples;
+    unsigned nb_samples;
+    unsigned samples_alloc;
+    int64_t total;
+} StageStats;
+
+/* With -duration, samples are reserved for up to this many frames a second */
+#define STAGE_RESERVE_FPS 1000
+
+/* Makes room for nb more samples up front, so that adding them does not
+ * allocate within the timed loop. Going past them still grows the array. */
+static void stage_reserve(StageStats *st, unsigned nb)
+{
+    int64_t *samples;
+
+    if (nb > UINT_MAX - st->samples_alloc)
+        return;
+
+    samples = av_realloc_array(st->samples, st->samples_alloc + nb, sizeof(*samples));
+    if (!samples)
+        return;
+    st->samples = samples;
+    st->samples_alloc += nb;
+}
+
+static void stage_add(StageStats *st, int64_t time)
+{
+    if (st->nb_samples == st->samples_alloc) {
+        unsigned alloc = FFMAX(st->samples_alloc * 2, 1024);
+        int64_t *samples = av_realloc_array(st->samples, alloc, sizeof(*samples));
+        if (!samples)
+            return;
+        st->samples = samples;
+        st->samples_alloc = alloc;
+    }
+
+    st->samples[st->nb_samples++] = time;
+    st->total += time;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t va = *(const int64_t *)a, vb = *(const int64_t *)b;
+    return (va > vb) - (va < vb);
+}
+
+/* Nearest-rank percentile, samples must be sorted */
+static double stage_percentile(const StageStats *st, int p)
+{
+    unsigned idx = ((uint64_t)st->nb_samples * p + 99) / 100;
+    return st->samples[FFMAX(idx, 1) - 1] / 1000.0;
+}
+
+/* All in milliseconds */
+typedef struct StageSummary {
+    unsigned count;
+    double min, mean, p50, p95, p99, max;
+} StageSummary;
+
+/* Returns 0 if the stage never ran. Sorts the samples. */
+static int stage_summarize(StageStats *st, StageSummary *sum)
+{
+    if (!st->nb_samples)
+        return 0;
+
+    qsort(st->samples, st->nb_samples, sizeof(*st->samples), cmp_int64);
+
+    *sum = (StageSummary) {
+        .count = st->nb_samples,
+        .min   = st->samples[0] / 1000.0,
+        .mean  = st->total / (1000.0 * st->nb_samples),
+        .p50   = stage_percentile(st, 50),
+        .p95   = stage_percentile(st, 95),
+        .p99   = stage_percentile(st, 99),
+        .max   = st->samples[st->nb_samples - 1] / 1000.0,
+    };
+
+    return 1;
+}
+
+static void print_stage_stats(const char *title, StageStats *stats)
+{
+    printf("%-12s %8s %9s %9s %9s %9s %9s %9s (ms)\n", title, "count",
+           "min", "mean", "p50", "p95", "p99", "max");
+
+    for (int i = 0; i < NB_STAGES; i++) {
+        StageSummary sum;
+        if (!stage_summarize(&stats[i], &sum))
+            continue;
+
+        printf("%-12s %8u %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+               stage_names[i], sum.count, sum.min, sum.mean,
+               sum.p50, sum.p95, sum.p99, sum.max);
+    }
+}
+
+static void stage_merge(StageStats *dst, const StageStats *src)
+{
+    for (unsigned i = 0; i < src->nb_samples; i++)
+        stage_add(dst, src->samples[i]);
+}
+
+static void stage_stats_free(StageStats *stats)
+{
+    for (int i = 0; i < NB_STAGES; i++)
+        av_freep(&stats[i].samples);
+}
+
+/* GPU timing, by submitting timestamp writes on a queue of our own around
+ * the Vulkan work libavutil and libavcodec submit. The start timestamp is
+ * written as soon as it is submitted, while the end one waits for the
+ * frame's timeline semaphores, which the work signals once done. This
+ * measures when the GPU finished relative to when it was handed the work,
+ * including any time it spent queued. */
+#define GPU_TIMER_SLOTS 64
+
+#define GPU_TIMER_FUNCS(X)                 \
+    X(GetPhysicalDeviceProperties)         \
+    X(GetPhysicalDeviceQueueFamilyProperties) \
+    X(GetDeviceQueue)                      \
+    X(CreateCommandPool)                   \
+    X(DestroyCommandPool)                  \
+    X(AllocateCommandBuffers)              \
+    X(BeginCommandBuffer)                  \
+    X(EndCommandBuffer)                    \
+    X(CmdResetQueryPool)                   \
+    X(CmdWriteTimestamp)                   \
+    X(CreateQueryPool)                     \
+    X(DestroyQueryPool)                    \
+    X(GetQueryPoolResults)                 \
+    X(CreateFence)                         \
+    X(DestroyFence)                        \
+    X(WaitForFences)                       \
+    X(ResetFences)                         \
+    X(QueueSubmit)
+
+typedef struct GPUTimerSlot {
+    VkCommandBuffer cmd[2]; /* Start and end timestamp writes */
+    VkFence fence;          /* Signalled once the end timestamp is written */
+    enum BenchStage stage;
+    enum {
+        SLOT_FREE,
+        SLOT_OPEN,       /* Start submitted, the end is yet to be */
+        SLOT_PENDING,    /* End submitted, the timestamps are yet to be read */
+        SLOT_COLLECTING, /* Being read by a thread not holding the lock */
+    } state;
+} GPUTimerSlot;
+
+typedef struct GPUTimer {
+    AVHWDeviceContext *dev_ctx;
+    AVVulkanDeviceContext *hwctx;
+    pthread_mutex_t lock;
+
+#define DECLARE_VK_FN(name) PFN_vk##name name;
+    struct {
+        GPU_TIMER_FUNCS(DECLARE_VK_FN)
+    } vk;
+
+    uint32_t qf;
+    uint32_t qi;
+    VkQueue queue;
+    double period;    /* Nanoseconds per tick */
+    uint64_t ts_mask; /* Valid timestamp bits */
+
+    VkCommandPool cmd_pool;
+    VkQueryPool query_pool;
+    GPUTimerSlot slots[GPU_TIMER_SLOTS];
+    unsigned next_slot;
+
+    StageStats stats[NB_STAGES];
+    int nb_intervals;
+    uint64_t first_start;
+    uint64_t last_end;
+    uint64_t busy;    /* Ticks during which any timed work was in flight */
+} GPUTimer;
+
+/* Waits for a slot's timestamps, which only its owner may do, and without
+ * holding the lock, so that the other streams are not held up meanwhile */
+static int gpu_timer_wait(GPUTimer *t, GPUTimerSlot *slot, uint64_t ts[2])
+{
+    VkResult ret;
+    VkDevice dev = t->hwctx->act_dev;
+    int idx = slot - t->slots;
+
+    t->vk.WaitForFences(dev, 1, &slot->fence, VK_TRUE, UINT64_MAX);
+    ret = t->vk.GetQueryPoolResults(dev, t->query_pool, 2*idx, 2,
+                                    2 * sizeof(*ts), ts, sizeof(*ts),
+                                    VK_QUERY_RESULT_64_BIT |
+                                    VK_QUERY_RESULT_WAIT_BIT);
+    t->vk.ResetFences(dev, 1, &slot->fence);
+
+    ts[0] &= t->ts_mask;
+    ts[1] &= t->ts_mask;
+    return ret != VK_SUCCESS || ts[1] < ts[0] ? AVERROR_EXTERNAL : 0;
+}
+
+/* Accounts for the timestamps of a stage, with the lock held */
+static void gpu_timer_add(GPUTimer *t, enum BenchStage stage,
+                          const uint64_t ts[2])
+{
+    stage_add(&t->stats[stage], (ts[1] - ts[0]) * t->period / 1000.0);
+
+    /* Intervals come in roughly in order, so overlaps are merged with the
+     * last one only */
+    if (!t->nb_intervals++)
+        t->first_start = ts[0];
+    if (ts[1] > t->last_end) {
+        t->busy += ts[1] - FFMAX(ts[0], t->last_end);
+        t->last_end = ts[1];
+    }
+}
+
+/* Waits for a slot's timestamps and accounts for them, once nothing else
+ * uses the timer */
+static void gpu_timer_collect(GPUTimer *t, GPUTimerSlot *slot)
+{
+    uint64_t ts[2];
+
+    if (gpu_timer_wait(t, slot, ts) >= 0)
+        gpu_timer_add(t, slot->stage, ts);
+    slot->state = SLOT_FREE;
+}
+
+static int gpu_timer_submit(GPUTimer *t, GPUTimerSlot *slot, int end,
+                            const AVFrame *frame)
+{
+    VkResult ret;
+    VkSemaphore sems[AV_NUM_DATA_POINTERS];
+    uint64_t sem_values[AV_NUM_DATA_POINTERS];
+    VkPipelineStageFlags wait_stages[AV_NUM_DATA_POINTERS];
+    int nb_sems = 0;
+
+    if (end) {
+        AVHWFramesContext *hwfc = (AVHWFramesContext *)frame->hw_frames_ctx->data;
+        AVVulkanFramesContext *vkfc = hwfc->hwctx;
+        AVVkFrame *vkf = (AVVkFrame *)frame->data[0];
+
+        vkfc->lock_frame(hwfc, vkf);
+        for (; nb_sems < AV_NUM_DATA_POINTERS && vkf->sem[nb_sems]; nb_sems++) {
+            sems[nb_sems] = vkf->sem[nb_sems];
+            sem_values[nb_sems] = vkf->sem_value[nb_sems];
+            wait_stages[nb_sems] = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+        }
+        vkfc->unlock_frame(hwfc, vkf);
+    }
+
+    VkTimelineSemaphoreSubmitInfo ts_info = {
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .waitSemaphoreValueCount = nb_sems,
+        .pWaitSemaphoreValues = sem_values,
+    };
+    VkSubmitInfo info = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .pNext = &ts_info,
+        .waitSemaphoreCount = nb_sems,
+        .pWaitSemaphores = sems,
+        .pWaitDstStageMask = wait_stages,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &slot->cmd[end],
+    };
+
+    t->hwctx->lock_queue(t->dev_ctx, t->qf, t->qi);
+    ret = t->vk.QueueSubmit(t->queue, 1, &info, end ? slot->fence : VK_NULL_HANDLE);
+    t->hwctx->unlock_queue(t->dev_ctx, t->qf, t->qi);
+    if (ret != VK_SUCCESS) {
+        printf("Error submitting timestamp query: %i\n", ret);
+        return AVERROR_EXTERNAL;
+    }
+
+    return 0;
+}
+
+/* Returns the slot to pass to gpu_timer_end(), or -1 if timing is off. The
+ * work goes untimed if every slot is still waiting for its end. */
+static int gpu_timer_begin(GPUTimer *t, enum BenchStage stage)
+{
+    int idx = -1, err;
+    GPUTimerSlot *slot = NULL;
+    uint64_t ts[2];
+
+    if (!t)
+        return -1;
+
+    pthread_mutex_lock(&t->lock);
+
+    for (int i = 0; i < GPU_TIMER_SLOTS && !slot; i++) {
+        idx = (t->next_slot + i) % GPU_TIMER_SLOTS;
+        if (t->slots[idx].state == SLOT_FREE ||
+            t->slots[idx].state == SLOT_PENDING)
+            slot = &t->slots[idx];
+    }
+    if (!slot) {
+        pthread_mutex_unlock(&t->lock);
+        return -1;
+    }
+    t->next_slot = (idx + 1) % GPU_TIMER_SLOTS;
+
+    /* The slot is taken out of the ring before waiting for the timestamps
+     * it still holds */
+    if (slot->state == SLOT_PENDING) {
+        slot->state = SLOT_COLLECTING;
+        pthread_mutex_unlock(&t->lock);
+        err = gpu_timer_wait(t, slot, ts);
+        pthread_mutex_lock(&t->lock);
+        if (err >= 0)
+            gpu_timer_add(t, slot->stage, ts);
+    }
+    slot->state = SLOT_OPEN;
+    slot->stage = stage;
+
+    pthread_mutex_unlock(&t->lock);
+
+    err = gpu_timer_submit(t, slot, 0, NULL);
+    if (err < 0) {
+        pthread_mutex_lock(&t->lock);
+        slot->state = SLOT_FREE;
+        pthread_mutex_unlock(&t->lock);
+        return -1;
+    }
+
+    return idx;
+}
+
+/* Frame is the one the timed work signals the semaphores of once done, or
+ * NULL if the work failed or gave no frame, to give up the slot untimed */
+static void gpu_timer_end(GPUTimer *t, int idx, const AVFrame *frame)
+{
+    GPUTimerSlot *slot;
+    int err = AVERROR(EINVAL);
+
+    if (idx < 0)
+        return;
+
+    slot = &t->slots[idx];
+    if (frame)
+        err = gpu_timer_submit(t, slot, 1, frame);
+
+    pthread_mutex_lock(&t->lock);
+    slot->state = err < 0 ? SLOT_FREE : SLOT_PENDING;
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void gpu_timer_uninit(GPUTimer *t)
+{
+    VkDevice dev = t->hwctx->act_dev;
+
+    for (int i = 0; i < GPU_TIMER_SLOTS; i++) {
+        if (t->slots[i].state == SLOT_PENDING)
+            gpu_timer_collect(t, &t->slots[i]);
+        if (t->slots[i].fence)
+            t->vk.DestroyFence(dev, t->slots[i].fence, t->hwctx->alloc);
+    }
+
+    if (t->query_pool)
+        t->vk.DestroyQueryPool(dev, t->query_pool, t->hwctx->alloc);
+    if (t->cmd_pool)
+        t->vk.DestroyCommandPool(dev, t->cmd_pool, t->hwctx->alloc);
+
+    pthread_mutex_destroy(&t->lock);
+    stage_stats_free(t->stats);
+}
+
+static int gpu_timer_init(GPUTimer *t, AVBufferRef *hw_dev_ref)
+{
+    VkResult ret;
+    uint32_t nb_qf_props = 0;
+    VkQueueFamilyProperties *qf_props;
+    VkPhysicalDeviceProperties props;
+    int valid_bits = 0;
+
+    t->dev_ctx = (AVHWDeviceContext *)hw_dev_ref->data;
+    t->hwctx = t->dev_ctx->hwctx;
+    VkDevice dev = t->hwctx->act_dev;
+    pthread_mutex_init(&t->lock, NULL);
+
+#define LOAD_VK_FN(name)                                                      \
+    t->vk.name = (PFN_vk##name)t->hwctx->get_proc_addr(t->hwctx->inst,      \
+                                                       "vk" #name);          \
+    if (!t->vk.name) {                                                        \
+        printf("Error loading Vulkan function vk" #name "\n");               \
+        return AVERROR(ENOSYS);                                               \
+    }
+    GPU_TIMER_FUNCS(LOAD_VK_FN)
+#undef LOAD_VK_FN
+
+    t->vk.GetPhysicalDeviceProperties(t->hwctx->phys_dev, &props);
+    t->period = props.limits.timestampPeriod;
+
+    t->vk.GetPhysicalDeviceQueueFamilyProperties(t->hwctx->phys_dev,
+                                                 &nb_qf_props, NULL);
+    qf_props = av_calloc(nb_qf_props, sizeof(*qf_props));
+    if (!qf_props)
+        return AVERROR(ENOMEM);
+    t->vk.GetPhysicalDeviceQueueFamilyProperties(t->hwctx->phys_dev,
+                                                 &nb_qf_props, qf_props);
+
+    /* Any compute queue will do, as the end timestamp waits on semaphores.
+     * The last queue of the family is used, as it is the least likely to be
+     * shared with the work being timed. */
+    for (int i = 0; i < t->hwctx->nb_qf; i++) {
+        const AVVulkanDeviceQueueFamily *qf = &t->hwctx->qf[i];
+        if ((qf->flags & VK_QUEUE_COMPUTE_BIT) && qf->idx < nb_qf_props &&
+            qf_props[qf->idx].timestampValidBits) {
+            t->qf = qf->idx;
+            t->qi = qf->num - 1;
+            valid_bits = qf_props[qf->idx].timestampValidBits;
+            break;
+        }
+    }
+    av_free(qf_props);
+
+    if (!valid_bits) {
+        printf("No compute queue supporting timestamps found\n");
+        return AVERROR(ENOSYS);
+    }
+    t->ts_mask = valid_bits >= 64 ? UINT64_MAX : (UINT64_C(1) << valid_bits) - 1;
+
+    t->vk.GetDeviceQueue(dev, t->qf, t->qi, &t->queue);
+
+    VkCommandPoolCreateInfo pool_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .queueFamilyIndex = t->qf,
+    };
+    ret = t->vk.CreateCommandPool(dev, &pool_info, t->hwctx->alloc, &t->cmd_pool);
+    if (ret != VK_SUCCESS)
+        goto fail;
+
+    VkQueryPoolCreateInfo query_info = {
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount = 2*GPU_TIMER_SLOTS,
+    };
+    ret = t->vk.CreateQueryPool(dev, &query_info, t->hwctx->alloc, &t->query_pool);
+    if (ret != VK_SUCCESS)
+        goto fail;
+
+    /* The command buffers never change, so they are recorded only once */
+    for (int i = 0; i < GPU_TIMER_SLOTS; i++) {
+        GPUTimerSlot *slot = &t->slots[i];
+
+        VkCommandBufferAllocateInfo cmd_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = t->cmd_pool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 2,
+        };
+        ret = t->vk.AllocateCommandBuffers(dev, &cmd_info, slot->cmd);
+        if (ret != VK_SUCCESS)
+            goto fail;
+
+        VkFenceCreateInfo fence_info = {
+            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+        };
+        ret = t->vk.CreateFence(dev, &fence_info, t->hwctx->alloc, &slot->fence);
+        if (ret != VK_SUCCESS)
+            goto fail;
+
+        VkCommandBufferBeginInfo begin_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        };
+
+        t->vk.BeginCommandBuffer(slot->cmd[0], &begin_info);
+        t->vk.CmdResetQueryPool(slot->cmd[0], t->query_pool, 2*i, 2);
+        t->vk.CmdWriteTimestamp(slot->cmd[0], VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                                t->query_pool, 2*i);
+        ret = t->vk.EndCommandBuffer(slot->cmd[0]);
+        if (ret != VK_SUCCESS)
+            goto fail;
+
+        t->vk.BeginCommandBuffer(slot->cmd[1], &begin_info);
+        t->vk.CmdWriteTimestamp(slot->cmd[1], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                                t->query_pool, 2*i + 1);
+        ret = t->vk.EndCommandBuffer(slot->cmd[1]);
+        if (ret != VK_SUCCESS)
+            goto fail;
+    }
+
+    return 0;
+
+fail:
+    printf("Error initializing GPU timestamps: %i\n", ret);
+    return AVERROR_EXTERNAL;
+}
+
+/* Collects all outstanding timestamps, must be called before reading the
+ * results */
+static void gpu_timer_flush(GPUTimer *t)
+{
+    for (int i = 0; i < GPU_TIMER_SLOTS; i++)
+        if (t->slots[i].state == SLOT_PENDING)
+            gpu_timer_collect(t, &t->slots[i]);
+}
+
+/* Total GPU busy time in milliseconds, and the fraction of the timed span
+ * during which the GPU was busy */
+static double gpu_timer_busy(const GPUTimer *t, double *utilization)
+{
+    double busy = t->busy * t->period / 1e6;
+    double span = (t->last_end - t->first_start) * t->period / 1e6;
+    *utilization = span > 0 ? busy / span : 0.0;
+    return busy;
+}
+
+static void print_gpu_timer_stats(GPUTimer *t, int nb_frames)
+{
+    double busy, utilization;
+
+    if (!t->nb_intervals)
+        return;
+
+    print_stage_stats("gpu stage", t->stats);
+
+    busy = gpu_timer_busy(t, &utilization);
+    printf("GPU busy: %f ms per frame, utilization %.1f%%\n",
+           busy / FFMAX(nb_frames, 1), 100.0 * utilization);
+}
+
+typedef struct LatencyStamp {
+    int64_t pts;
+    int64_t time;
+} LatencyStamp;
+
+/* An encoder instance. When encoding in parallel, each one gets chunks of
+ * consecutive frames, and runs on a thread of its own. */
+typedef struct Encoder {
+    struct BenchContext *s;
+    AVCodecContext *avctx;
+    AVPacket *pkt;
+    StageStats stats; /* Encode stage times */
+
+    int64_t next_pts;
+
+    /* With -latency, the stamps of the frames in flight, by pts */
+    LatencyStamp *stamps;
+    unsigned stamps_size;
+    int nb_stamps;
+    StageStats latency;
+
+    /* Frames sent but not output yet */
+    int in_flight;
+    int max_in_flight;
+    int64_t in_flight_sum; /* Sampled after each frame */
+    int64_t in_flight_samples;
+
+    /* Parallel encoding only */
+    pthread_t thread;
+    int running;
+    AVThreadMessageQueue *in_queue;  /* Frames */
+    AVThreadMessageQueue *out_queue; /* Packets */
+} Encoder;
+
+typedef struct BenchContext {
+    const BenchOptions *opts;
+    int device; /* Index of the device the stream runs on */
+    InputContext in;
+
+    /* Hardware decoding only. Frames are allocated from decoding threads,
+     * hence the atomics. */
+    int hw_pool_extra;           /* Frames held downstream, on top of the DPB */
+    int hw_pool_size;            /* 0 if the pool grows as needed */
+    atomic_int hw_pool_out;      /* Frames of the pool not given back yet */
+    atomic_int pool_waits;       /* Allocations which found the pool empty */
+    atomic_llong pool_wait_time; /* Time spent waiting for a frame back */
+
+    AVBufferRef *hwfc_ref;     /* Frames context frames are uploaded into */
+    enum AVPixelFormat up_fmt; /* Software format frames are uploaded in */
+    int sw_encode;             /* Frames are encoded on the CPU instead */
+    enum ConvPath conv_path;   /* From the decoded format to the encoder's */
+    SwsContext *swc;
+    RepackContext repack;  /* Used over swc for repacks it has a kernel for */
+    SwsContext *fused_swc; /* -upload fused, set up for fused_width/height */
+    int fused_width, fused_height;
+    const char *converter; /* What converts frames, for the results */
+    AVFrame *temp;
+
+    /* Recycled buffers for temp, rather than allocating one per frame */
+    AVBufferPool *temp_pool;
+    int temp_width, temp_height;
+    unsigned temp_pool_gets;
+    unsigned temp_pool_misses;
+
+    /* Upload mapping only */
+    int map_decode;            /* The decoder can write into mapped frames */
+    int map_linesize_align[AV_NUM_DATA_POINTERS];
+    int64_t bytes_copied;      /* Bytes memcpy'd on the host to upload frames */
+
+    /* GPU conversion only, from hwfc_ref into the encoder's frames context */
+    AVFilterGraph *graph;
+    AVFilterContext *buffersrc;
+    AVFilterContext *buffersink;
+
+    Encoder *encoders;
+    int nb_encoders;
+
+    /* Encoded packets are muxed into a file, or just counted */
+    OutputContext out;
+    int64_t out_bytes;
+    int64_t out_wait;    /* Time spent waiting for the writer */
+    AVRational frame_rate;
+
+    /* Decoded frames decode_stage() loops over, instead of decoding */
+    AVFrame **cache;
+    int nb_cache;
+    int cache_pos;
+    uint8_t *cache_map; /* With -cache-file, the mapping the frames are in */
+    size_t cache_map_size;
+
+    /* Frames in flight in the encoders, as of each frame sent */
+    int64_t in_flight_sum;
+    int64_t in_flight_samples;
+    int max_in_flight;
+
+    /* Parallel encoding only */
+    int64_t nb_submitted; /* Frames handed out to the encoders */
+    pthread_t stitch_thread;
+    int stitching;
+
+    int max_frames;
+    /* Read by the progress reporter */
+    atomic_int nb_frames;
+    atomic_llong time_start; /* Start of measurement, once warmed up */
+    int64_t run_start;
+
+    /* With -numa, the node of the device the stream's threads run on */
+    const cpu_set_t *numa_cpus; /* NULL if not pinned */
+    const char *numa_cpus_str;
+    int numa_node;
+
+    /* Frames in the warm-up are not counted, their stages are not timed */
+    int nb_warmup;
+    atomic_int measuring;
+    atomic_int stop;      /* Enough frames were done, or time is up */
+    int64_t first_frame;  /* Time from the start of the run, or -1 */
+    int64_t warmup_time;
+
+    StageStats stats[NB_STAGES];
+    StageStats latency; /* From reading each packet to getting it encoded */
+    AllocStats allocs;
+    GPUTimer *gpu_timer;
+    int64_t elapsed;
+
+    /* For the results */
+    const char *dec_name;
+    const char *enc_name;
+    char *enc_opts;
+    int hwdec;                  /* Frames were decoded in hardware */
+    int dec_threads;            /* As libavcodec settled on */
+    int dec_thread_type;        /* Active FF_THREAD_* type, 0 if none */
+    enum AVPixelFormat dec_fmt; /* Software format frames were decoded in */
+    enum AVPixelFormat enc_fmt; /* Software format of the encoder's frames */
+
+    /* Pipelined mode only */
+    AVThreadMessageQueue *dec_queue; /* decode -> convert/upload */
+    AVThreadMessageQueue *up_queue;  /* convert/upload -> encode */
+} BenchContext;
+
+static void bench_stage_add(BenchContext *s, enum BenchStage stage, int64_t time)
+{
+    if (atomic_load_explicit(&s->measuring, memory_order_relaxed))
+        stage_add(&s->stats[stage], time);
+}
+
+static int bench_gpu_begin(BenchContext *s, enum BenchStage stage)
+{
+    if (!atomic_load_explicit(&s->measuring, memory_order_relaxed))
+        return -1;
+    return gpu_timer_begin(s->gpu_timer, stage);
+}
+
+#define TEMP_ALIGN 64
+
+static AVBufferRef *temp_pool_alloc(void *opaque, size_t size)
+{
+    BenchContext *s = opaque;
+    s->temp_pool_misses++;
+    return av_buffer_alloc(size);
+}
+
+/* Gets a buffer for s->temp from the staging pool, (re)creating the pool
+ * if the frame dimensions do not match those it was created for. */
+static int get_temp_buffer(BenchContext *s, int width, int height)
+{
+    int err;
+    AVFrame *temp = s->temp;
+
+    if (!s->temp_pool || s->temp_width != width || s->temp_height != height) {
+        int size = av_image_get_buffer_size(s->up_fmt, width, height, TEMP_ALIGN);
+        if (size < 0)
+            return size;
+
+        /* Buffers still out keep the old pool alive until returned */
+        av_buffer_pool_uninit(&s->temp_pool);
+        s->temp_pool = av_buffer_pool_init2(size, s, temp_pool_alloc, NULL);
+        if (!s->temp_pool)
+            return AVERROR(ENOMEM);
+
+        s->temp_width = width;
+        s->temp_height = height;
+    }
+
+    temp->buf[0] = av_buffer_pool_get(s->temp_pool);
+    if (!temp->buf[0])
+        return AVERROR(ENOMEM);
+    s->temp_pool_gets++;
+
+    temp->format = s->up_fmt;
+    temp->width = width;
+    temp->height = height;
+
+    err = av_image_fill_arrays(temp->data, temp->linesize, temp->buf[0]->data,
+                               s->up_fmt, width, height, TEMP_ALIGN);
+    if (err < 0) {
+        av_frame_unref(temp);
+        return err;
+    }
+
+    return 0;
+}
+
+static int convert_frame(BenchContext *s, AVFrame *dst, const AVFrame *src)
+{
+    int err;
+    int64_t start = av_gettime_relative();
+
+    if (s->repack.slice && src->format == s->repack.from &&
+        dst->format == s->repack.to) {
+        repack_frame(&s->repack, dst, src, 0);
+    } else {
+        err = sws_scale_frame(s->swc, dst, src);
+        if (err < 0) {
+            printf("Error scaling frame: %s\n", av_err2str(err));
+            return err;
+        }
+    }
+
+    bench_stage_add(s, STAGE_CONVERT, av_gettime_relative() - start);
+
+    return 0;
+}
+
+static int get_hw_frame(BenchContext *s, AVFrame *hw_frame)
+{
+    int err;
+    int64_t start = av_gettime_relative();
+
+    err = av_hwframe_get_buffer(s->hwfc_ref, hw_frame, 0);
+    if (err < 0) {
+        printf("Error allocating hardware frame\n");
+        return err;
+    }
+
+    bench_stage_add(s, STAGE_HW_ALLOC, av_gettime_relative() - start);
+
+    return 0;
+}
+
+static int64_t frame_bytes(const AVFrame *frame)
+{
+    int ret = av_image_get_buffer_size(frame->format, frame->width,
+                                       frame->height, 1);
+    return ret < 0 ? 0 : ret;
+}
+
+/* A Vulkan frame, mapped into host memory for the decoder to write into */
+typedef struct MappedFrame {
+    AVFrame *hw;
+    AVFrame *map;
+} MappedFrame;
+
+static void mapped_frame_free(void *opaque, uint8_t *data)
+{
+    MappedFrame *mf = (MappedFrame *)data;
+    av_frame_free(&mf->map);
+    av_frame_free(&mf->hw);
+    av_free(mf);
+}
+
+/* Frames whose buffer was handed out by map_get_buffer() */
+static MappedFrame *get_mapped_frame(BenchContext *s, const AVFrame *frame)
+{
+    if (!frame->buf[0] || av_buffer_get_opaque(frame->buf[0]) != s)
+        return NULL;
+    return (MappedFrame *)frame->buf[0]->data;
+}
+
+/* Frames the stages after decoding can hold on to at once, which a fixed
+ * size decoder pool must have room for on top of the frames it refers to */
+static int downstream_frames(const BenchOptions *opts, int nb_encoders)
+{
+    int nb = nb_encoders * opts->async_depth + opts->cache;
+
+    if (opts->pipeline)
+        nb += opts->dec_queue + opts->up_queue;
+    if (nb_encoders > 1)
+        nb += nb_encoders * (opts->enc_chunk + 1);
+
+    return nb;
+}
+
+/* get_format() which creates the hardware decoder's frames context itself,
+ * so that its pool is sized for the whole pipeline rather than the decoder
+ * alone */
+static enum AVPixelFormat hw_get_format(AVCodecContext *avctx,
+                                        const enum AVPixelFormat *fmts)
+{
+    BenchContext *s = avctx->opaque;
+    AVBufferRef *frames_ref = NULL;
+    const enum AVPixelFormat *p;
+    int err;
+
+    for (p = fmts; *p != AV_PIX_FMT_NONE && *p != AV_PIX_FMT_VULKAN; p++)
+        ;
+    if (*p == AV_PIX_FMT_NONE) {
+        printf("No Vulkan decoding for this stream, decoding in software\n");
+        return avcodec_default_get_format(avctx, fmts);
+    }
+
+    err = avcodec_get_hw_frames_parameters(avctx, avctx->hw_device_ctx,
+                                           AV_PIX_FMT_VULKAN, &frames_ref);
+    if (err < 0) {
+        printf("Error getting decoder frames parameters: %s\n", av_err2str(err));
+        return AV_PIX_FMT_NONE;
+    }
+
+    /* A pool of 0 frames grows as needed, and is left alone */
+    AVHWFramesContext *hwfc = (AVHWFramesContext *)frames_ref->data;
+    if (s->opts->hw_pool)
+        hwfc->initial_pool_size = s->opts->hw_pool;
+    else if (hwfc->initial_pool_size)
+        hwfc->initial_pool_size += s->hw_pool_extra;
+    s->hw_pool_size = hwfc->initial_pool_size;
+
+    err = av_hwframe_ctx_init(frames_ref);
+    if (err < 0) {
+        printf("Error creating decoder frames context: %s\n", av_err2str(err));
+        av_buffer_unref(&frames_ref);
+        return AV_PIX_FMT_NONE;
+    }
+
+    av_buffer_unref(&avctx->hw_frames_ctx);
+    avctx->hw_frames_ctx = frames_ref;
+
+    return AV_PIX_FMT_VULKAN;
+}
+
+/* A frame of the decoder's pool, counted as out until it is given back */
+typedef struct PoolFrame {
+    AVBufferRef *buf;
+    atomic_int *nb_out;
+} PoolFrame;
+
+static void pool_frame_release(void *opaque, uint8_t *data)
+{
+    PoolFrame *pf = opaque;
+    atomic_fetch_sub(pf->nb_out, 1);
+    av_buffer_unref(&pf->buf);
+    av_free(pf);
+}
+
+/* libavutil's Vulkan frames contexts only preallocate initial_pool_size
+ * frames, and allocate more whenever they run out, so a fixed size is
+ * enforced here by counting the frames out */
+static int pool_get_buffer(BenchContext *s, AVCodecContext *avctx,
+                           AVFrame *frame, int flags)
+{
+    PoolFrame *pf;
+    int err;
+
+    if (!s->hw_pool_size || frame->format != AV_PIX_FMT_VULKAN)
+        return avcodec_default_get_buffer2(avctx, frame, flags);
+
+    /* Taken before allocating, as decoding threads allocate at once */
+    if (atomic_fetch_add(&s->hw_pool_out, 1) >= s->hw_pool_size) {
+        atomic_fetch_sub(&s->hw_pool_out, 1);
+        return AVERROR(ENOMEM);
+    }
+
+    pf = av_malloc(sizeof(*pf));
+    if (!pf) {
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    err = avcodec_default_get_buffer2(avctx, frame, flags);
+    if (err < 0)
+        goto fail;
+
+    /* Same data, so that the frame still points to its AVVkFrame */
+    pf->buf = frame->buf[0];
+    pf->nb_out = &s->hw_pool_out;
+    frame->buf[0] = av_buffer_create(pf->buf->data, pf->buf->size,
+                                     pool_frame_release, pf, 0);
+    if (!frame->buf[0]) {
+        frame->buf[0] = pf->buf;
+        av_frame_unref(frame);
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    av_free(pf);
+    atomic_fetch_sub(&s->hw_pool_out, 1);
+    return err;
+}
+
+#define POOL_WAIT_TIMEOUT 2000000
+
+/* get_buffer2() for hardware decoding. Rather than failing as soon as all
+ * frames of a fixed size pool are out, waits for the stages after decoding
+ * to give one back, counting how often and for how long. Only other threads
+ * can give frames back: the pipeline's stages, or parallel encoders. */
+static int hw_get_buffer(AVCodecContext *avctx, AVFrame *frame, int flags)
+{
+    BenchContext *s = avctx->opaque;
+    int64_t start = 0, now;
+    int can_wait = s->opts->pipeline || s->nb_encoders > 1;
+    int err;
+
+    for (;;) {
+        err = pool_get_buffer(s, avctx, frame, flags);
+        if (err != AVERROR(ENOMEM) || frame->format != AV_PIX_FMT_VULKAN)
+            break;
+
+        now = av_gettime_relative();
+        if (!start)
+            start = now;
+        if (!can_wait || now - start > POOL_WAIT_TIMEOUT) {
+            printf("Decoder pool of %i frames exhausted, see -hw-pool\n",
+                   s->hw_pool_size);
+            break;
+        }
+        av_usleep(100);
+    }
+
+    if (start && atomic_load_explicit(&s->measuring, memory_order_relaxed)) {
+        atomic_fetch_add(&s->pool_waits, 1);
+        atomic_fetch_add(&s->pool_wait_time, av_gettime_relative() - start);
+    }
+
+    return err;
+}
+
+/* get_buffer2() which decodes straight into host-mapped Vulkan frames from
+ * s->hwfc_ref, so that no copy is needed to upload them. Falls back to the
+ * default allocator for anything the frames cannot hold. */
+static int map_get_buffer(AVCodecContext *avctx, AVFrame *frame, int flags)
+{
+    int err;
+    BenchContext *s = avctx->opaque;
+    AVHWFramesContext *hwfc;
+    MappedFrame *mf;
+
+    if (!s->map_decode || frame->format != s->up_fmt)
+        return avcodec_default_get_buffer2(avctx, frame, flags);
+
+    hwfc = (AVHWFramesContext *)s->hwfc_ref->data;
+    if (frame->width > hwfc->width || frame->height > hwfc->height)
+        return avcodec_default_get_buffer2(avctx, frame, flags);
+
+    mf = av_mallocz(sizeof(*mf));
+    if (!mf)
+        return AVERROR(ENOMEM);
+
+    mf->hw = av_frame_alloc();
+    mf->map = av_frame_alloc();
+    if (!mf->hw || !mf->map) {
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    err = av_hwframe_get_buffer(s->hwfc_ref, mf->hw, 0);
+    if (err < 0)
+        goto fail;
+
+    mf->map->format = s->up_fmt;
+    err = av_hwframe_map(mf->map, mf->hw,
+                         AV_HWFRAME_MAP_WRITE | AV_HWFRAME_MAP_OVERWRITE);
+    if (err < 0)
+        goto fail;
+
+    for (int i = 0; i < FF_ARRAY_ELEMS(mf->map->data) && mf->map->data[i]; i++) {
+        if (mf->map->linesize[i] % s->map_linesize_align[i]) {
+            mapped_frame_free(NULL, (uint8_t *)mf);
+            return avcodec_default_get_buffer2(avctx, frame, flags);
+        }
+        frame->data[i] = mf->map->data[i];
+        frame->linesize[i] = mf->map->linesize[i];
+    }
+
+    mf->hw->width = avctx->width;
+    mf->hw->height = avctx->height;
+
+    frame->buf[0] = av_buffer_create((uint8_t *)mf, sizeof(*mf),
+                                     mapped_frame_free, s, 0);
+    if (!frame->buf[0]) {
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    mapped_frame_free(NULL, (uint8_t *)mf);
+    return err;
+}
+
+/* Output bytes converted at a time with -upload fused: few enough for a
+ * band's source and output to stay in a core's L2 cache */
+#define FUSED_BAND_SIZE (256 << 10)
+
+/* Sets up the context -upload fused converts slices of frames with. Unlike
+ * sws_scale_frame(), the slice API needs the conversion set up up front. */
+static int fused_sws_init(BenchContext *s, int width, int height)
+{
+    int err;
+
+    s->fused_swc = sws_alloc_context();
+    if (!s->fused_swc)
+        return AVERROR(ENOMEM);
+
+    err = av_opt_set_int(s->fused_swc, "srcw", width, 0);
+    if (err >= 0)
+        err = av_opt_set_int(s->fused_swc, "srch", height, 0);
+    if (err >= 0)
+        err = av_opt_set_int(s->fused_swc, "src_format", s->dec_fmt, 0);
+    if (err >= 0)
+        err = av_opt_set_int(s->fused_swc, "dstw", width, 0);
+    if (err >= 0)
+        err = av_opt_set_int(s->fused_swc, "dsth", height, 0);
+    if (err >= 0)
+        err = av_opt_set_int(s->fused_swc, "dst_format", s->up_fmt, 0);
+    if (err >= 0)
+        err = av_opt_set_int(s->fused_swc, "threads", s->opts->sws_threads, 0);
+    if (err >= 0)
+        err = av_opt_set(s->fused_swc, "sws_flags", s->opts->sws_flags, 0);
+    if (err >= 0)
+        err = sws_init_context(s->fused_swc, NULL, NULL);
+    if (err < 0)
+        return err;
+
+    s->fused_width = width;
+    s->fused_height = height;
+    return 0;
+}
+
+/* Converts src into the mapped frame dst band by band, so that the mapping
+ * is written in order by all threads together, rather than as one stream
+ * per thread, each a slice of the frame apart */
+static int fused_convert(BenchContext *s, AVFrame *dst, const AVFrame *src)
+{
+    int err, align, band;
+
+    band = FUSED_BAND_SIZE / FFMAX(FFABS(dst->linesize[0]), 1);
+    band = FFALIGN(FFMAX(band, 2), 2);
+
+    if (s->repack.slice && src->format == s->repack.from &&
+        dst->format == s->repack.to) {
+        repack_frame(&s->repack, dst, src, band);
+        return 0;
+    }
+
+    /* The slice API only works on a context set up for the exact
+     * conversion, anything else is converted in one go */
+    if (!s->fused_swc || src->format != s->dec_fmt || dst->format != s->up_fmt ||
+        src->width != s->fused_width || src->height != s->fused_height) {
+        err = sws_scale_frame(s->swc, dst, src);
+        if (err < 0)
+            printf("Error scaling frame: %s\n", av_err2str(err));
+        return err;
+    }
+
+    align = sws_receive_slice_alignment(s->fused_swc);
+    band = (band + align - 1) / align * align;
+
+    err = sws_frame_start(s->fused_swc, dst, src);
+    if (err >= 0) {
+        /* Without scaling, each band of input gives the same band of output */
+        for (int y = 0; err >= 0 && y < src->height; y += band) {
+            int h = FFMIN(band, src->height - y);
+            err = sws_send_slice(s->fused_swc, y, h);
+            if (err >= 0)
+                err = sws_receive_slice(s->fused_swc, y, h);
+        }
+        sws_frame_end(s->fused_swc);
+    }
+    if (err < 0)
+        printf("Error scaling frame: %s\n", av_err2str(err));
+
+    return err;
+}
+
+/* Uploads a software frame by mapping a Vulkan frame and writing into it
+ * directly, either as the conversion destination or with a plain copy when
+ * no conversion is needed. With -upload fused, the conversion is counted as
+ * part of the upload. */
+static int map_upload_frame(BenchContext *s, AVFrame *frame, AVFrame *hw_frame)
+{
+    int err;
+    AVFrame *map = s->temp;
+    int64_t start, time = 0;
+
+    err = get_hw_frame(s, hw_frame);
+    if (err < 0)
+        return err;
+
+    /* Conversion is timed separately, and not counted in the upload */
+    start = av_gettime_relative();
+
+    map->format = s->up_fmt;
+    err = av_hwframe_map(map, hw_frame,
+                         AV_HWFRAME_MAP_WRITE | AV_HWFRAME_MAP_OVERWRITE);
+    if (err < 0) {
+        printf("Error mapping hardware frame: %s\n", av_err2str(err));
+        goto end;
+    }
+
+    /* The frames context may be larger than the frames, to fit the decoder */
+    map->width = hw_frame->width = frame->width;
+    map->height = hw_frame->height = frame->height;
+
+    if (frame->format != s->up_fmt && s->opts->upload == UPLOAD_FUSED) {
+        err = fused_convert(s, map, frame);
+    } else if (frame->format != s->up_fmt) {
+        time = av_gettime_relative() - start;
+        err = convert_frame(s, map, frame);
+        start = av_gettime_relative();
+    } else {
+        err = av_frame_copy(map, frame);
+        if (err < 0)
+            printf("Error copying frame: %s\n", av_err2str(err));
+        if (atomic_load_explicit(&s->measuring, memory_order_relaxed))
+            s->bytes_copied += frame_bytes(frame);
+    }
+
+end:
+    /* Unmapping flushes the writes out to the device */
+    av_frame_unref(map);
+    if (err < 0)
+        av_frame_unref(hw_frame);
+    else
+        bench_stage_add(s, STAGE_UPLOAD, time + av_gettime_relative() - start);
+    return err;
+}
+
+/* Software encoders get frames on the CPU: hardware frames are downloaded,
+ * and converted to the encoder's format if needed like software ones.
+ * frame is unreferenced in all cases. */
+static int download_frame(BenchContext *s, AVFrame *frame, AVFrame *sw_frame)
+{
+    int err;
+
+    if (frame->hw_frames_ctx) {
+        int64_t start = av_gettime_relative();
+        err = av_hwframe_transfer_data(sw_frame, frame, 0);
+        av_frame_unref(frame);
+        if (err < 0) {
+            printf("Error downloading frame: %s\n", av_err2str(err));
+            return err;
+        }
+        bench_stage_add(s, STAGE_UPLOAD, av_gettime_relative() - start);
+        if (atomic_load_explicit(&s->measuring, memory_order_relaxed))
+            s->bytes_copied += frame_bytes(sw_frame);
+
+        if (sw_frame->format == s->up_fmt)
+            return 0;
+        av_frame_move_ref(frame, sw_frame);
+    }
+
+    if (frame->format == s->up_fmt) {
+        av_frame_move_ref(sw_frame, frame);
+        return 0;
+    }
+
+    /* Staging buffers stay out until the frame is encoded */
+    err = get_temp_buffer(s, frame->width, frame->height);
+    if (err < 0)
+        printf("Error allocating temporary frame: %s\n", av_err2str(err));
+    else
+        err = convert_frame(s, s->temp, frame);
+
+    if (err >= 0)
+        av_frame_move_ref(sw_frame, s->temp);
+    av_frame_unref(s->temp);
+    av_frame_unref(frame);
+    return err;
+}
+
+/* Converts a decoded frame to the upload format if needed, and uploads it
+ * into a frame from s->hwfc_ref. Hardware frames are passed through as-is.
+ * frame is unreferenced in all cases. */
+static int transfer_frame(BenchContext *s, AVFrame *frame, AVFrame *hw_frame)
+{
+    int err;
+    AVFrame *src = frame;
+
+    if (s->sw_encode)
+        return download_frame(s, frame, hw_frame);
+
+    if (frame->hw_frames_ctx) {
+        av_frame_move_ref(hw_frame, frame);
+        return 0;
+    }
+
+    /* Unmapping flushes the decoder's writes out to the device, which can
+     * only be done once nothing else holds the frame. Frames the decoder
+     * still refers to, or that are cached, are copied instead. */
+    MappedFrame *mf = get_mapped_frame(s, frame);
+    if (mf && av_buffer_get_ref_count(frame->buf[0]) == 1) {
+        av_frame_unref(mf->map);
+        err = av_frame_ref(hw_frame, mf->hw);
+        av_frame_unref(frame);
+        return err;
+    }
+
+    if (s->opts->upload != UPLOAD_COPY) {
+        err = map_upload_frame(s, frame, hw_frame);
+        av_frame_unref(frame);
+        return err;
+    }
+
+    if (frame->format != s->up_fmt) {
+        err = get_temp_buffer(s, frame->width, frame->height);
+        if (err < 0) {
+            printf("Error allocating temporary frame: %s\n", av_err2str(err));
+            goto end;
+        }
+
+        err = convert_frame(s, s->temp, frame);
+        if (err < 0)
+            goto end;
+
+        src = s->temp;
+    }
+
+    err = get_hw_frame(s, hw_frame);
+    if (err < 0)
+        goto end;
+
+    int64_t start = av_gettime_relative();
+    int gpu_slot = bench_gpu_begin(s, STAGE_UPLOAD);
+    err = av_hwframe_transfer_data(hw_frame, src, 0);
+    if (err < 0) {
+        printf("Error uploading frame: %s\n", av_err2str(err));
+        gpu_timer_end(s->gpu_timer, gpu_slot, NULL);
+        av_frame_unref(hw_frame);
+        goto end;
+    }
+    gpu_timer_end(s->gpu_timer, gpu_slot, hw_frame);
+    bench_stage_add(s, STAGE_UPLOAD, av_gettime_relative() - start);
+    if (atomic_load_explicit(&s->measuring, memory_order_relaxed))
+        s->bytes_copied += frame_bytes(src);
+
+end:
+    av_frame_unref(s->temp);
+    av_frame_unref(frame);
+    return err;
+}
+
+/* Builds a filtergraph which takes frames from s->hwfc_ref and converts them
+ * on the GPU, into the format the encoder gets. */
+static int init_gpu_convert(BenchContext *s, const char *filters)
+{
+    int err;
+    AVFilterInOut *outputs = avfilter_inout_alloc();
+    AVFilterInOut *inputs = avfilter_inout_alloc();
+    AVBufferSrcParameters *par = av_buffersrc_parameters_alloc();
+
+    s->graph = avfilter_graph_alloc();
+    if (!outputs || !inputs || !par || !s->graph) {
+        err = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    s->buffersrc = avfilter_graph_alloc_filter(s->graph,
+                                               avfilter_get_by_name("buffer"),
+                                               "in");
+    s->buffersink = avfilter_graph_alloc_filter(s->graph,
+                                                avfilter_get_by_name("buffersink"),
+                                                "out");
+    if (!s->buffersrc || !s->buffersink) {
+        err = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    par->format = AV_PIX_FMT_VULKAN;
+    par->width = s->in.dec->width;
+    par->height = s->in.dec->height;
+    par->time_base = av_make_q(1, 1);
+    par->hw_frames_ctx = s->hwfc_ref;
+    err = av_buffersrc_parameters_set(s->buffersrc, par);
+    if (err < 0)
+        goto end;
+
+    err = avfilter_init_dict(s->buffersrc, NULL);
+    if (err < 0)
+        goto end;
+    err = avfilter_init_dict(s->buffersink, NULL);
+    if (err < 0)
+        goto end;
+
+    outputs->name = av_strdup("in");
+    outputs->filter_ctx = s->buffersrc;
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = s->buffersink;
+    if (!outputs->name || !inputs->name) {
+        err = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    err = avfilter_graph_parse_ptr(s->graph, filters, &inputs, &outputs, NULL);
+    if (err < 0)
+        goto end;
+
+    err = avfilter_graph_config(s->graph, NULL);
+
+end:
+    if (err < 0)
+        printf("Error creating conversion filtergraph \"%s\": %s\n",
+               filters, av_err2str(err));
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    av_free(par);
+    return err;
+}
+
+/* Converts frames from s->hwfc_ref into enc_fmt on the GPU, or with the
+ * -gpu-filter graph. *hwfc_ref is set to the frames context the encoder then
+ * gets frames from. */
+static int setup_gpu_convert(BenchContext *s, enum AVPixelFormat enc_fmt,
+                             AVBufferRef **hwfc_ref, int verbose)
+{
+    int err;
+    char filters[64];
+
+    snprintf(filters, sizeof(filters), "scale_vulkan=format=%s",
+             av_get_pix_fmt_name(enc_fmt));
+
+    err = init_gpu_convert(s, s->opts->gpu_filter ? s->opts->gpu_filter : filters);
+    if (err < 0)
+        return err;
+
+    *hwfc_ref = av_buffersink_get_hw_frames_ctx(s->buffersink);
+    if (!*hwfc_ref) {
+        printf("Conversion filtergraph does not output Vulkan frames\n");
+        return AVERROR(EINVAL);
+    }
+
+    if (verbose)
+        printf("Converting from %s to %s on the GPU\n",
+               av_get_pix_fmt_name(((AVHWFramesContext *)s->hwfc_ref->data)->sw_format),
+               av_get_pix_fmt_name(((AVHWFramesContext *)(*hwfc_ref)->data)->sw_format));
+
+    return 0;
+}
+
+/* Runs the upload stage on a decoded frame. Returns AVERROR(EAGAIN) if
+ * no frame came out of the GPU conversion yet. */
+static int upload_frame(BenchContext *s, AVFrame *frame, AVFrame *hw_frame)
+{
+    /* Frames converted or uploaded into do not get the properties of the
+     * decoded frame, so its latency stamp is carried over by hand. The
+     * filtergraph keeps it. */
+    AVBufferRef *stamp = frame->opaque_ref;
+    frame->opaque_ref = NULL;
+
+    int err = transfer_frame(s, frame, hw_frame);
+    if (err >= 0 && !hw_frame->opaque_ref)
+        hw_frame->opaque_ref = stamp;
+    else
+        av_buffer_unref(&stamp);
+    if (err < 0 || !s->graph)
+        return err;
+
+    int64_t start = av_gettime_relative();
+    int gpu_slot = bench_gpu_begin(s, STAGE_GPU_CONVERT);
+    err = av_buffersrc_add_frame(s->buffersrc, hw_frame);
+    if (err < 0) {
+        printf("Error submitting frame for conversion: %s\n", av_err2str(err));
+        gpu_timer_end(s->gpu_timer, gpu_slot, NULL);
+        av_frame_unref(hw_frame);
+        return err;
+    }
+
+    err = av_buffersink_get_frame(s->buffersink, hw_frame);
+    if (err >= 0) {
+        bench_stage_add(s, STAGE_GPU_CONVERT, av_gettime_relative() - start);
+    } else if (err != AVERROR(EAGAIN)) {
+        printf("Error converting frame: %s\n", av_err2str(err));
+    }
+    gpu_timer_end(s->gpu_timer, gpu_slot, err >= 0 ? hw_frame : NULL);
+
+    return err;
+}
+
+static int decode_stage(BenchContext *s, AVFrame *frame)
+{
+    int err;
+    int64_t start = av_gettime_relative();
+
+    /* Cached frames are shared, nothing writes into decoded frames */
+    if (s->nb_cache) {
+        err = av_frame_ref(frame, s->cache[s->cache_pos]);
+        s->cache_pos = (s->cache_pos + 1) % s->nb_cache;
+        /* Which is as good as when they are read */
+        if (err >= 0 && s->in.stamps)
+            err = stamp_now(s->in.stamps, &frame->opaque_ref);
+        return err;
+    }
+
+    err = decode_frame(&s->in, frame);
+    if (err < 0) {
+        if (err != AVERROR_EOF)
+            printf("Error decoding frame: %s\n", av_err2str(err));
+        return err;
+    }
+
+    bench_stage_add(s, STAGE_DECODE, av_gettime_relative() - start);
+
+    return 0;
+}
+
+/* Takes the reference of an encoded packet, in the order of the frames.
+ * Offset is added to its timestamps, in frames. Only ever called from the
+ * last stage. */
+static int packet_done(BenchContext *s, AVPacket *pkt, int64_t offset)
+{
+    int err;
+    int measuring = atomic_load_explicit(&s->measuring, memory_order_relaxed);
+
+    if (measuring)
+        s->out_bytes += pkt->size;
+
+    if (!s->out.mux) {
+        av_packet_unref(pkt);
+        return 0;
+    }
+
+    int64_t start = av_gettime_relative();
+    err = output_write(&s->out, pkt, s->encoders[0].avctx->time_base,
+                       offset);
+    if (measuring)
+        s->out_wait += av_gettime_relative() - start;
+
+    return err;
+}
+
+/* Only ever called from the last stage */
+static void frame_done(BenchContext *s)
+{
+    const BenchOptions *opts = s->opts;
+    int64_t now = av_gettime();
+    int nb_frames;
+
+    if (s->first_frame < 0)
+        s->first_frame = now - s->run_start;
+
+    if (s->nb_warmup < opts->warmup) {
+        if (++s->nb_warmup == opts->warmup) {
+            s->warmup_time = now - s->run_start;
+            atomic_store(&s->time_start, now);
+            atomic_store(&s->measuring, 1);
+        }
+        return;
+    }
+
+    nb_frames = atomic_fetch_add_explicit(&s->nb_frames, 1,
+                                          memory_order_relaxed) + 1;
+    int64_t start = atomic_load_explicit(&s->time_start, memory_order_relaxed);
+    if (nb_frames >= s->max_frames ||
+        (opts->duration && now - start >= opts->duration))
+        atomic_store(&s->stop, 1);
+}
+
+static int latency_push(Encoder *e, int64_t pts, int64_t time)
+{
+    LatencyStamp *stamps = av_fast_realloc(e->stamps, &e->stamps_size,
+                                           (e->nb_stamps + 1) * sizeof(*stamps));
+    if (!stamps)
+        return AVERROR(ENOMEM);
+
+    e->stamps = stamps;
+    e->stamps[e->nb_stamps++] = (LatencyStamp) { .pts = pts, .time = time };
+
+    return 0;
+}
+
+/* Records the latency of the frame pkt was encoded from. Packets without a
+ * pts are taken to be of the oldest frame in flight. */
+static void latency_pop(Encoder *e, const AVPacket *pkt)
+{
+    int i = 0;
+
+    if (pkt->pts != AV_NOPTS_VALUE)
+        while (i < e->nb_stamps && e->stamps[i].pts != pkt->pts)
+            i++;
+    if (i >= e->nb_stamps)
+        return;
+
+    if (atomic_load_explicit(&e->s->measuring, memory_order_relaxed))
+        stage_add(&e->latency, av_gettime_relative() - e->stamps[i].time);
+
+    memmove(&e->stamps[i], &e->stamps[i + 1],
+            (e->nb_stamps - i - 1) * sizeof(*e->stamps));
+    e->nb_stamps--;
+}
+
+/* Hands out the packet in e->pkt: to the stitching thread when encoding in
+ * parallel, or straight to the output */
+static int encoder_output(Encoder *e)
+{
+    int err;
+    BenchContext *s = e->s;
+    AVPacket *pkt;
+
+    if (s->nb_encoders == 1) {
+        err = packet_done(s, e->pkt, 0);
+        if (err >= 0)
+            frame_done(s);
+        return err;
+    }
+
+    pkt = av_packet_alloc();
+    if (!pkt)
+        return AVERROR(ENOMEM);
+    av_packet_move_ref(pkt, e->pkt);
+
+    err = av_thread_message_queue_send(e->out_queue, &pkt, 0);
+    if (err < 0)
+        av_packet_free(&pkt);
+
+    return err;
+}
+
+/* Submits a frame to the encoder, or flushes it if frame is NULL, and
+ * outputs the packets which are ready. The encoder keeps up to async_depth
+ * frames in flight, and only waits for the oldest one once that many are. */
+static int encode_frame(Encoder *e, AVFrame *frame)
+{
+    int err, sent = 0;
+    BenchContext *s = e->s;
+    int64_t start = av_gettime_relative();
+    int gpu_slot = frame && !s->sw_encode ? bench_gpu_begin(s, STAGE_ENCODE) : -1;
+
+    /* Decoded timestamps repeat when not demuxing, and encoders which
+     * reorder frames need them to increase */
+    if (frame)
+        frame->pts = e->next_pts++;
+
+    /* The frame is lost past the encoder, so packets get matched back to
+     * its stamp by pts */
+    if (frame && frame->opaque_ref) {
+        err = latency_push(e, frame->pts, *(const int64_t *)frame->opaque_ref->data);
+        if (err < 0)
+            return err;
+    }
+
+    for (;;) {
+        if (!sent) {
+            err = avcodec_send_frame(e->avctx, frame);
+            if (err >= 0) {
+                sent = 1;
+                e->in_flight += !!frame;
+            } else if (err != AVERROR(EAGAIN)) {
+                printf("Error sending frame for encoding: %s\n", av_err2str(err));
+                return err;
+            }
+        }
+
+        /* Only blocks if the frame could not be sent, or when flushing */
+        err = avcodec_receive_packet(e->avctx, e->pkt);
+        if ((err == AVERROR(EAGAIN) && sent) || err == AVERROR_EOF)
+            break;
+        if (err == AVERROR(EAGAIN)) {
+            printf("Encoder takes neither frames nor gives packets\n");
+            return AVERROR_BUG;
+        } else if (err < 0) {
+            printf("Error receiving encoded packet: %s\n", av_err2str(err));
+            return err;
+        }
+
+        e->in_flight--;
+        latency_pop(e, e->pkt);
+        err = encoder_output(e);
+        if (err < 0)
+            return err;
+    }
+
+    if (!frame)
+        return 0;
+
+    /* Encoders may run on threads of their own, so they keep their own
+     * figures */
+    if (atomic_load_explicit(&s->measuring, memory_order_relaxed)) {
+        stage_add(&e->stats, av_gettime_relative() - start);
+        e->in_flight_sum += e->in_flight;
+        e->in_flight_samples++;
+        e->max_in_flight = FFMAX(e->max_in_flight, e->in_flight);
+    }
+    gpu_timer_end(s->gpu_timer, gpu_slot, frame);
+
+    return 0;
+}
+
+/* Parallel encoding. Frames are handed out to the encoders in chunks of
+ * consecutive frames, in turn. As each encoder outputs its packets in
+ * order, taking them from the encoders in the same turn puts all of them
+ * back in order, with no reordering buffer. */
+static void *encoder_thread(void *arg)
+{
+    Encoder *e = arg;
+    AVFrame *frame;
+    int err;
+
+    thread_allocs = &e->s->allocs;
+
+    for (;;) {
+        err = av_thread_message_queue_recv(e->in_queue, &frame, 0);
+        if (err < 0)
+            break;
+
+        err = encode_frame(e, frame);
+        av_frame_free(&frame);
+        if (err < 0)
+            break;
+    }
+
+    if (err == AVERROR_EOF) {
+        err = encode_frame(e, NULL);
+        if (err >= 0)
+            err = AVERROR_EOF;
+    }
+
+    av_thread_message_queue_set_err_send(e->in_queue, err);
+    av_thread_message_queue_set_err_recv(e->out_queue, err);
+
+    return (void *)(intptr_t)err;
+}
+
+static void *stitch_thread(void *arg)
+{
+    BenchContext *s = arg;
+    int chunk = s->opts->enc_chunk;
+    AVPacket *pkt;
+    int err;
+
+    thread_allocs = &s->allocs;
+
+    for (int64_t i = 0;; i++) {
+        Encoder *e = &s->encoders[(i / chunk) % s->nb_encoders];
+        /* Each encoder numbers its own frames from 0, so its packets are
+         * moved to where its chunk starts among all frames */
+        int64_t offset = (i / chunk - i / chunk / s->nb_encoders) * chunk;
+
+        /* Only ever returns EOF once all frames handed out are done */
+        err = av_thread_message_queue_recv(e->out_queue, &pkt, 0);
+        if (err < 0)
+            break;
+
+        err = packet_done(s, pkt, offset);
+        av_packet_free(&pkt);
+        if (err < 0)
+            break;
+
+        frame_done(s);
+    }
+
+    /* Stops all encoders if one of them failed */
+    for (int i = 0; i < s->nb_encoders; i++) {
+        av_thread_message_queue_set_err_send(s->encoders[i].in_queue, err);
+        av_thread_message_queue_set_err_send(s->encoders[i].out_queue, err);
+    }
+
+    return (void *)(intptr_t)err;
+}
+
+static void free_queued_frame(void *msg)
+{
+    av_frame_free((AVFrame **)msg);
+}
+
+/* Starts the encoder and stitching threads when encoding in parallel. Has
+ * to be followed by encoders_stop() even if it fails. */
+static int encoders_start(BenchContext *s)
+{
+    int err;
+    int depth = s->opts->enc_chunk;
+
+    if (s->nb_encoders == 1)
+        return 0;
+
+    for (int i = 0; i < s->nb_encoders; i++) {
+        Encoder *e = &s->encoders[i];
+
+        /* Each encoder must be able to hold a whole chunk while the
+         * others get theirs */
+        err = av_thread_message_queue_alloc(&e->in_queue, depth, sizeof(AVFrame *));
+        if (err < 0)
+            return err;
+        err = av_thread_message_queue_alloc(&e->out_queue, depth, sizeof(AVPacket *));
+        if (err < 0)
+            return err;
+
+        av_thread_message_queue_set_free_func(e->in_queue, free_queued_frame);
+        av_thread_message_queue_set_free_func(e->out_queue, free_queued_packet);
+    }
+
+    for (int i = 0; i < s->nb_encoders; i++) {
+        Encoder *e = &s->encoders[i];
+        err = pthread_create(&e->thread, NULL, encoder_thread, e);
+        if (err)
+            goto fail;
+        e->running = 1;
+    }
+
+    err = pthread_create(&s->stitch_thread, NULL, stitch_thread, s);
+    if (err)
+        goto fail;
+    s->stitching = 1;
+
+    return 0;
+
+fail:
+    err = AVERROR(err);
+    printf("Error creating thread: %s\n", av_err2str(err));
+    return err;
+}
+
+/* Flushes the parallel encoders and waits for them to be done. Returns
+ * the first error any of them ran into. */
+static int encoders_stop(BenchContext *s)
+{
+    int err = 0;
+    void *ret;
+
+    if (s->nb_encoders == 1)
+        return 0;
+
+    for (int i = 0; i < s->nb_encoders; i++) {
+        Encoder *e = &s->encoders[i];
+        if (!e->in_queue || !e->out_queue)
+            break;
+
+        av_thread_message_queue_set_err_recv(e->in_queue, AVERROR_EOF);
+        /* Nothing takes the packets without the stitching thread */
+        if (!s->stitching)
+            av_thread_message_queue_set_err_send(e->out_queue, AVERROR_EOF);
+    }
+
+    for (int i = 0; i < s->nb_encoders; i++) {
+        Encoder *e = &s->encoders[i];
+        if (!e->running)
+            continue;
+
+        pthread_join(e->thread, &ret);
+        if (!err && (intptr_t)ret != AVERROR_EOF)
+            err = (intptr_t)ret;
+        e->running = 0;
+    }
+
+    if (s->stitching) {
+        pthread_join(s->stitch_thread, &ret);
+        if (!err && (intptr_t)ret != AVERROR_EOF)
+            err = (intptr_t)ret;
+        s->stitching = 0;
+    }
+
+    for (int i = 0; i < s->nb_encoders; i++) {
+        av_thread_message_queue_free(&s->encoders[i].in_queue);
+        av_thread_message_queue_free(&s->encoders[i].out_queue);
+    }
+
+    return err;
+}
+
+/* The last stage. Frames are done once their packet is out. When encoding
+ * in parallel, the frame is only handed to the encoder whose chunk it is
+ * in. frame is unreferenced, and once there are no more frames, a NULL
+ * frame flushes the encoder. */
+static int encode_stage(BenchContext *s, AVFrame *frame)
+{
+    int err = 0;
+
+    if (s->nb_encoders > 1) {
+        /* Parallel encoders are flushed by encoders_stop() */
+        if (!frame)
+            return 0;
+
+        int64_t chunk = s->nb_submitted++ / s->opts->enc_chunk;
+        Encoder *e = &s->encoders[chunk % s->nb_encoders];
+        AVFrame *queued = av_frame_alloc();
+        if (!queued)
+            return AVERROR(ENOMEM);
+
+        av_frame_move_ref(queued, frame);
+        err = av_thread_message_queue_send(e->in_queue, &queued, 0);
+        if (err < 0)
+            av_frame_free(&queued);
+        return err;
+    }
+
+    if (s->opts->encode) {
+        err = encode_frame(&s->encoders[0], frame);
+    } else if (frame) {
+        /* Without encoding, frames are done once uploaded */
+        if (frame->opaque_ref && atomic_load_explicit(&s->measuring, memory_order_relaxed))
+            stage_add(&s->latency, av_gettime_relative() -
+                                   *(const int64_t *)frame->opaque_ref->data);
+        frame_done(s);
+    }
+
+    if (frame)
+        av_frame_unref(frame);
+
+    return err;
+}
+
+/* Progress is printed from a thread of its own every few hundred
+ * milliseconds, rather than once per frame from within the timed loop */
+#define PROGRESS_WINDOW 8
+
+typedef struct ProgressReporter {
+    BenchContext *streams;
+    int nb_streams;
+    int interval; /* Milliseconds */
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stop;
+
+    /* Last reports, for the instantaneous fps over a sliding window */
+    int64_t times[PROGRESS_WINDOW];
+    int frames[PROGRESS_WINDOW];
+    unsigned nb_reports;
+} ProgressReporter;
+
+static void print_progress(ProgressReporter *p)
+{
+    int64_t now = av_gettime();
+    int nb_frames = 0;
+    int oldest, idx = p->nb_reports++ % PROGRESS_WINDOW;
+    double fps = 0.0, cur_fps;
+
+    /* With several streams, the fps are added up */
+    for (int i = 0; i < p->nb_streams; i++) {
+        BenchContext *s = &p->streams[i];
+        int frames = atomic_load_explicit(&s->nb_frames, memory_order_relaxed);
+        int64_t start = atomic_load(&s->time_start);
+        if (now - start > 0)
+            fps += frames / ((now - start) / 1e6);
+        nb_frames += frames;
+    }
+
+    p->times[idx] = now;
+    p->frames[idx] = nb_frames;
+
+    /* The start of the run counts as the very first report */
+    if (p->nb_reports <= PROGRESS_WINDOW) {
+        cur_fps = fps;
+    } else {
+        oldest = p->nb_reports % PROGRESS_WINDOW;
+        cur_fps = (nb_frames - p->frames[oldest]) /
+                  ((now - p->times[oldest]) / 1e6);
+    }
+
+    printf("\rFrames done: %i, fmt: %i, fps: %f, current fps: %f",
+           nb_frames, p->streams[0].in.dec->pix_fmt, fps, cur_fps);
+    if (p->nb_streams > 1)
+        printf(", streams: %i", p->nb_streams);
+    fflush(stdout);
+}
+
+static void *progress_thread(void *arg)
+{
+    ProgressReporter *p = arg;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += p->interval / 1000;
+        ts.tv_nsec += (p->interval % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+
+        pthread_cond_timedwait(&p->cond, &p->lock, &ts);
+        if (!p->stop)
+            print_progress(p);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+static int progress_start(ProgressReporter *p, BenchContext *streams,
+                          int nb_streams, int interval)
+{
+    int err;
+
+    *p = (ProgressReporter) {
+        .streams = streams,
+        .nb_streams = nb_streams,
+        .interval = interval,
+    };
+
+    if (!interval)
+        return 0;
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    err = pthread_create(&p->thread, NULL, progress_thread, p);
+    if (err) {
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->cond);
+        p->interval = 0;
+        return AVERROR(err);
+    }
+
+    return 0;
+}
+
+/* Stops the reporter, and prints the final progress line */
+static void progress_stop(ProgressReporter *p)
+{
+    if (p->interval) {
+        pthread_mutex_lock(&p->lock);
+        p->stop = 1;
+        pthread_cond_signal(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+
+        pthread_join(p->thread, NULL);
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->cond);
+    }
+
+    print_progress(p);
+}
+
+static int run_serial(BenchContext *s)
+{
+    int err = 0;
+    AVFrame *frame = av_frame_alloc();
+    AVFrame *hw_frame = av_frame_alloc();
+    if (!frame || !hw_frame) {
+        err = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    /* Frames in flight in the encoder still get through once the last
+     * stage has decided to stop, so never submit more than are needed */
+    int64_t max_frames = (int64_t)s->opts->warmup + s->max_frames;
+    for (int64_t i = 0; i < max_frames && !atomic_load(&s->stop);) {
+        err = decode_stage(s, frame);
+        if (err == AVERROR_EOF) {
+            err = 0;
+            break;
+        } else if (err < 0) {
+            break;
+        }
+
+        err = upload_frame(s, frame, hw_frame);
+        if (err == AVERROR(EAGAIN))
+            continue;
+        else if (err < 0)
+            break;
+
+        err = encode_stage(s, hw_frame);
+        if (err < 0)
+            break;
+        i++;
+    }
+
+    if (err >= 0)
+        err = encode_stage(s, NULL);
+
+end:
+    av_frame_free(&frame);
+    av_frame_free(&hw_frame);
+    return err;
+}
+
+/* Each pipeline stage passes EOF or its error on to the next stage's queue
+ * once it stops, and makes the previous stage's sends fail so that it stops
+ * too. Frames still queued are freed along with the queues. */
+static void *decode_thread(void *arg)
+{
+    BenchContext *s = arg;
+    int err = 0;
+
+    thread_allocs = &s->allocs;
+
+    /* Decoding without threads of its own happens right here */
+    if (s->opts->dec_cpus_str)
+        pthread_setaffinity_np(pthread_self(), sizeof(s->opts->dec_cpus),
+                               &s->opts->dec_cpus);
+
+    /* Frames in flight will still get through once the last stage has
+     * decided to stop, so never decode more than are needed */
+    int64_t max_frames = (int64_t)s->opts->warmup + s->max_frames;
+    for (int64_t i = 0; i < max_frames && !atomic_load(&s->stop); i++) {
+        AVFrame *frame = av_frame_alloc();
+        if (!frame) {
+            err = AVERROR(ENOMEM);
+            break;
+        }
+
+        err = decode_stage(s, frame);
+        if (err >= 0)
+            err = av_thread_message_queue_send(s->dec_queue, &frame, 0);
+        if (err < 0) {
+            av_frame_free(&frame);
+            break;
+        }
+    }
+
+    if (err >= 0)
+        err = AVERROR_EOF;
+    av_thread_message_queue_set_err_recv(s->dec_queue, err);
+
+    return (void *)(intptr_t)err;
+}
+
+static void *upload_thread(void *arg)
+{
+    BenchContext *s = arg;
+    AVFrame *frame, *hw_frame;
+    int err;
+
+    thread_allocs = &s->allocs;
+
+    for (;;) {
+        err = av_thread_message_queue_recv(s->dec_queue, &frame, 0);
+        if (err < 0)
+            break;
+
+        hw_frame = av_frame_alloc();
+        if (!hw_frame)
+            err = AVERROR(ENOMEM);
+        else
+            err = upload_frame(s, frame, hw_frame);
+        av_frame_free(&frame);
+
+        if (err == AVERROR(EAGAIN)) {
+            av_frame_free(&hw_frame);
+            continue;
+        }
+
+        if (err >= 0)
+            err = av_thread_message_queue_send(s->up_queue, &hw_frame, 0);
+        if (err < 0) {
+            av_frame_free(&hw_frame);
+            break;
+        }
+    }
+
+    av_thread_message_queue_set_err_send(s->dec_queue, err);
+    av_thread_message_queue_set_err_recv(s->up_queue, err);
+
+    return (void *)(intptr_t)err;
+}
+
+static void *encode_thread(void *arg)
+{
+    BenchContext *s = arg;
+    AVFrame *frame;
+    int err;
+
+    thread_allocs = &s->allocs;
+
+    for (;;) {
+        err = av_thread_message_queue_recv(s->up_queue, &frame, 0);
+        if (err < 0)
+            break;
+
+        err = encode_stage(s, frame);
+        av_frame_free(&frame);
+        if (err < 0)
+            break;
+    }
+
+    if (err == AVERROR_EOF) {
+        err = encode_stage(s, NULL);
+        if (err >= 0)
+            err = AVERROR_EOF;
+    }
+
+    av_thread_message_queue_set_err_send(s->up_queue, err);
+
+    return (void *)(intptr_t)err;
+}
+
+static int run_pipelined(BenchContext *s)
+{
+    int err;
+    void *(*stages[])(void *) = { decode_thread, upload_thread, encode_thread };
+    pthread_t threads[FF_ARRAY_ELEMS(stages)];
+    int nb_threads = 0;
+
+    err = av_thread_message_queue_alloc(&s->dec_queue, s->opts->dec_queue,
+                                        sizeof(AVFrame *));
+    if (err < 0)
+        goto end;
+    err = av_thread_message_queue_alloc(&s->up_queue, s->opts->up_queue,
+                                        sizeof(AVFrame *));
+    if (err < 0)
+        goto end;
+
+    av_thread_message_queue_set_free_func(s->dec_queue, free_queued_frame);
+    av_thread_message_queue_set_free_func(s->up_queue, free_queued_frame);
+
+    for (; nb_threads < FF_ARRAY_ELEMS(stages); nb_threads++) {
+        err = pthread_create(&threads[nb_threads], NULL, stages[nb_threads], s);
+        if (err) {
+            err = AVERROR(err);
+            printf("Error creating thread: %s\n", av_err2str(err));
+            /* Wind down the stages that did start */
+            av_thread_message_queue_set_err_send(s->dec_queue, err);
+            av_thread_message_queue_set_err_recv(s->dec_queue, err);
+            av_thread_message_queue_set_err_send(s->up_queue, err);
+            av_thread_message_queue_set_err_recv(s->up_queue, err);
+            break;
+        }
+    }
+
+    for (int i = 0; i < nb_threads; i++) {
+        void *ret;
+        pthread_join(threads[i], &ret);
+        if (!err && (intptr_t)ret != AVERROR_EOF)
+            err = (intptr_t)ret;
+    }
+
+end:
+    av_thread_message_queue_free(&s->dec_queue);
+    av_thread_message_queue_free(&s->up_queue);
+    return err;
+}
+
+/* Runs one stream's benchmark to the end */
+static int run_stream(BenchContext *s)
+{
+    int err, ret;
+
+    s->run_start = av_gettime();
+    atomic_store(&s->time_start, s->run_start);
+    s->first_frame = -1;
+    s->measuring = !s->opts->warmup;
+
+    /* The thread running the stream, and every thread it starts */
+    s->allocs.measuring = &s->measuring;
+    s->out.allocs = &s->allocs;
+    thread_allocs = &s->allocs;
+
+    err = output_start(&s->out);
+    if (err >= 0)
+        err = encoders_start(s);
+    if (err >= 0 && s->opts->pipeline)
+        err = run_pipelined(s);
+    else if (err >= 0)
+        err = run_serial(s);
+
+    /* Errors of the encoders are the cause of any error of the stage
+     * feeding them */
+    ret = encoders_stop(s);
+    if (ret < 0)
+        err = ret;
+
+    /* All packets have to be written for the time to count */
+    ret = output_stop(&s->out);
+    if (ret < 0 && err >= 0)
+        err = ret;
+
+    for (int i = 0; i < s->nb_encoders; i++) {
+        Encoder *e = &s->encoders[i];
+        stage_merge(&s->stats[STAGE_ENCODE], &e->stats);
+        stage_merge(&s->latency, &e->latency);
+        s->in_flight_sum += e->in_flight_sum;
+        s->in_flight_samples += e->in_flight_samples;
+        s->max_in_flight = FFMAX(s->max_in_flight, e->max_in_flight);
+    }
+
+    if (s->measuring)
+        s->elapsed = av_gettime() - atomic_load(&s->time_start);
+
+    thread_allocs = NULL;
+    return err;
+}
+
+/* Parses a list of CPUs such as 0-3,8 */
+static int parse_cpu_list(const char *str, cpu_set_t *set)
+{
+    const char *p = str;
+
+    CPU_ZERO(set);
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+
+        if (end == p)
+            goto fail;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p)
+                goto fail;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            goto fail;
+
+        for (long i = first; i <= last; i++)
+            CPU_SET(i, set);
+
+        p = end;
+        if (*p == ',' && p[1])
+            p++;
+        else if (*p)
+            goto fail;
+    }
+
+    if (CPU_COUNT(set))
+        return 0;
+
+fail:
+    printf("Invalid CPU list: %s\n", str);
+    return AVERROR(EINVAL);
+}
+
+/* Pins the calling thread to the CPUs of a NUMA node, and has it allocate
+ * memory from the node where possible. Threads started after inherit both. */
+static int numa_bind(int node, const cpu_set_t *cpus)
+{
+    unsigned long mask[16] = { 0 };
+    const int bits = 8 * sizeof(*mask);
+    int err;
+
+    if (node >= FF_ARRAY_ELEMS(mask) * bits)
+        return AVERROR(EINVAL);
+
+    err = pthread_setaffinity_np(pthread_self(), sizeof(*cpus), cpus);
+    if (err)
+        return AVERROR(err);
+
+    /* There is no libc wrapper for it, short of libnuma */
+    mask[node / bits] |= 1UL << (node % bits);
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+                FF_ARRAY_ELEMS(mask) * bits) < 0)
+        return AVERROR(errno);
+
+    return 0;
+}
+
+/* Undoes numa_bind(), back to the given CPUs and the default policy */
+static int numa_unbind(const cpu_set_t *cpus)
+{
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(*cpus), cpus);
+    if (err)
+        return AVERROR(err);
+
+    if (syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0) < 0)
+        return AVERROR(errno);
+
+    return 0;
+}
+
+static void *stream_thread(void *arg)
+{
+    BenchContext *s = arg;
+
+    if (s->numa_cpus) {
+        int err = numa_bind(s->numa_node, s->numa_cpus);
+        if (err < 0) {
+            printf("Error binding to NUMA node %i: %s\n", s->numa_node,
+                   av_err2str(err));
+            return (void *)(intptr_t)err;
+        }
+    }
+
+    return (void *)(intptr_t)run_stream(s);
+}
+
+/* Runs all streams at once, each from a thread of its own */
+static int run_streams(BenchContext *streams, int nb_streams)
+{
+    int err = 0;
+    pthread_t *threads;
+    int nb_threads = 0;
+
+    /* Run right here, which is left bound to be undone by the caller */
+    if (nb_streams == 1)
+        return (intptr_t)stream_thread(&streams[0]);
+
+    threads = av_calloc(nb_streams, sizeof(*threads));
+    if (!threads)
+        return AVERROR(ENOMEM);
+
+    for (; nb_threads < nb_streams; nb_threads++) {
+        err = pthread_create(&threads[nb_threads], NULL, stream_thread,
+                             &streams[nb_threads]);
+        if (err) {
+            err = AVERROR(err);
+            printf("Error creating thread: %s\n", av_err2str(err));
+            /* Wind down the streams that did start */
+            for (int i = 0; i < nb_threads; i++)
+                atomic_store(&streams[i].stop, 1);
+            break;
+        }
+    }
+
+    for (int i = 0; i < nb_threads; i++) {
+        void *ret;
+        pthread_join(threads[i], &ret);
+        if ((intptr_t)ret < 0) {
+            printf("Stream %i failed: %s\n", i, av_err2str((intptr_t)ret));
+            if (!err)
+                err = (intptr_t)ret;
+        }
+    }
+
+    av_free(threads);
+    return err;
+}
+
+static double bench_fps(const BenchContext *s)
+{
+    return s->elapsed > 0 ? s->nb_frames / (s->elapsed / 1e6) : 0.0;
+}
+
+#define MAX_DEVICES 16
+
+/* One of the Vulkan devices streams are spread over */
+typedef struct BenchDevice {
+    const char *name;
+    AVBufferRef *ref;
+    GPUTimer gpu_timer;
+
+    /* Where the device sits, found by device_locate() */
+    char pci[16];        /* Empty if unknown */
+    int numa_node;       /* -1 if unknown */
+    cpu_set_t numa_cpus; /* CPUs of the node */
+    char *numa_cpus_str;
+    int has_budget;      /* VK_EXT_memory_budget, for the memory in use */
+
+    /* Results */
+    int nb_streams;
+    int nb_frames;
+    double fps;
+    int64_t mem_local; /* Memory in use at the end, in bytes, -1 if unknown */
+    int64_t mem_host;
+} BenchDevice;
+
+static int read_line(const char *path, char *buf, int size)
+{
+    FILE *f = fopen(path, "r");
+    int ok = f && fgets(buf, size, f);
+
+    if (f)
+        fclose(f);
+    if (!ok)
+        return AVERROR(EIO);
+
+    buf[strcspn(buf, "\n")] = 0;
+    return 0;
+}
+
+/* Whether the physical device supports an extension, enabled or not */
+static int device_has_extension(AVVulkanDeviceContext *hwctx, const char *name)
+{
+    PFN_vkEnumerateDeviceExtensionProperties enum_exts;
+    VkExtensionProperties *exts = NULL;
+    uint32_t nb_exts = 0;
+    int found = 0;
+
+    enum_exts = (PFN_vkEnumerateDeviceExtensionProperties)
+                hwctx->get_proc_addr(hwctx->inst, "vkEnumerateDeviceExtensionProperties");
+    if (!enum_exts)
+        return 0;
+
+    if (enum_exts(hwctx->phys_dev, NULL, &nb_exts, NULL) == VK_SUCCESS &&
+        (exts = av_calloc(nb_exts, sizeof(*exts))) &&
+        enum_exts(hwctx->phys_dev, NULL, &nb_exts, exts) == VK_SUCCESS)
+        for (uint32_t i = 0; i < nb_exts; i++)
+            found |= !strcmp(exts[i].extensionName, name);
+    av_free(exts);
+
+    return found;
+}
+
+/* Finds the device's PCI address, and from it the NUMA node it is attached
+ * to and the CPUs of that node. Not finding them is not an error. Also
+ * notes whether the memory in use can be queried. */
+static void device_locate(BenchDevice *dev)
+{
+    AVHWDeviceContext *dev_ctx = (AVHWDeviceContext *)dev->ref->data;
+    AVVulkanDeviceContext *hwctx = dev_ctx->hwctx;
+    PFN_vkGetPhysicalDeviceProperties2 get_props;
+    char path[128], buf[4096];
+    long node;
+
+    dev->numa_node = -1;
+    dev->has_budget = device_has_extension(hwctx, "VK_EXT_memory_budget");
+
+    get_props = (PFN_vkGetPhysicalDeviceProperties2)
+                hwctx->get_proc_addr(hwctx->inst, "vkGetPhysicalDeviceProperties2");
+    if (!get_props || !device_has_extension(hwctx, "VK_EXT_pci_bus_info"))
+        return;
+
+    VkPhysicalDevicePCIBusInfoPropertiesEXT pci = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PCI_BUS_INFO_PROPERTIES_EXT,
+    };
+    VkPhysicalDeviceProperties2 props = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+        .pNext = &pci,
+    };
+    get_props(hwctx->phys_dev, &props);
+    snprintf(dev->pci, sizeof(dev->pci), "%04x:%02x:%02x.%x", pci.pciDomain,
+             pci.pciBus, pci.pciDevice, pci.pciFunction);
+
+    /* -1 without NUMA */
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/numa_node", dev->pci);
+    if (read_line(path, buf, sizeof(buf)) < 0 || (node = strtol(buf, NULL, 10)) < 0)
+        return;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%li/cpulist", node);
+    if (read_line(path, buf, sizeof(buf)) < 0 ||
+        parse_cpu_list(buf, &dev->numa_cpus) < 0)
+        return;
+
+    dev->numa_cpus_str = av_strdup(buf);
+    if (dev->numa_cpus_str)
+        dev->numa_node = node;
+}
+
+/* Sums up what the process has in use of the device's device-local heaps,
+ * and of its other heaps, which are host memory. The usage only counts
+ * once memory is allocated, so pools have to be set up by then. */
+static void device_memory(BenchDevice *dev)
+{
+    AVHWDeviceContext *dev_ctx = (AVHWDeviceContext *)dev->ref->data;
+    AVVulkanDeviceContext *hwctx = dev_ctx->hwctx;
+    PFN_vkGetPhysicalDeviceMemoryProperties2 get_mem_props;
+
+    dev->mem_local = dev->mem_host = -1;
+
+    get_mem_props = (PFN_vkGetPhysicalDeviceMemoryProperties2)
+                    hwctx->get_proc_addr(hwctx->inst, "vkGetPhysicalDeviceMemoryProperties2");
+    if (!get_mem_props || !dev->has_budget)
+        return;
+
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT,
+    };
+    VkPhysicalDeviceMemoryProperties2 props = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2,
+        .pNext = &budget,
+    };
+    get_mem_props(hwctx->phys_dev, &props);
+
+    dev->mem_local = dev->mem_host = 0;
+    for (uint32_t i = 0; i < props.memoryProperties.memoryHeapCount; i++) {
+        if (props.memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+            dev->mem_local += budget.heapUsage[i];
+        else
+            dev->mem_host += budget.heapUsage[i];
+    }
+}
+
+/* Makes the kernel start over on the peak resident set size of the process,
+ * so that each run gets a peak of its own. Needs Linux 4.0. */
+static int peak_rss_reset(void)
+{
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    int ok = fd >= 0 && write(fd, "5", 1) == 1;
+
+    if (fd >= 0)
+        close(fd);
+    return ok ? 0 : AVERROR(errno);
+}
+
+/* Peak resident set size in bytes, since the last reset. Without resets,
+ * the peak of the whole process. */
+static int64_t peak_rss(void)
+{
+    FILE *f = fopen("/proc/self/status", "r");
+    struct rusage usage;
+    char line[256];
+    long long kb = -1;
+
+    while (f && fgets(line, sizeof(line), f))
+        if (sscanf(line, "VmHWM: %lld kB", &kb) == 1)
+            break;
+    if (f)
+        fclose(f);
+
+    if (kb < 0 && !getrusage(RUSAGE_SELF, &usage))
+        kb = usage.ru_maxrss;
+
+    return kb < 0 ? -1 : kb * 1024;
+}
+
+/* All streams run at once, and the devices they run on */
+typedef struct BenchRun {
+    BenchContext *streams;
+    int nb_streams;
+    BenchDevice devices[MAX_DEVICES];
+    int nb_devices;
+
+    BenchContext total; /* Results of all streams added up */
+    int64_t peak_rss;   /* Of the whole process, in bytes, -1 if unknown */
+} BenchRun;
+
+/* Adds up the results of all streams into run->total, which otherwise
+ * describes the first stream, and into each device's results. The time is
+ * that of the slowest stream. */
+static void bench_aggregate(BenchRun *run)
+{
+    BenchContext *total = &run->total;
+    const BenchContext *s0 = &run->streams[0];
+    int nb_frames = 0, measuring = 1;
+
+    *total = (BenchContext) {
+        .opts        = s0->opts,
+        .in          = s0->in,
+        .up_fmt      = s0->up_fmt,
+        .first_frame = -1,
+        /* GPU times are only meaningful per device */
+        .gpu_timer   = run->nb_devices == 1 ? s0->gpu_timer : NULL,
+        .dec_name    = s0->dec_name,
+        .enc_name    = s0->enc_name,
+        .enc_opts    = s0->enc_opts,
+        .nb_encoders = s0->nb_encoders,
+        .nb_cache    = s0->nb_cache,
+        .conv_path   = s0->conv_path,
+        .converter   = s0->converter,
+        .frame_rate  = s0->frame_rate,
+        .hwdec       = s0->hwdec,
+        .dec_threads = s0->dec_threads,
+        .dec_fmt     = s0->dec_fmt,
+        .enc_fmt     = s0->enc_fmt,
+    };
+    total->in.io.stats = (InputIOStats) { 0 };
+    total->hw_pool_size = s0->hw_pool_size;
+    total->dec_thread_type = s0->dec_thread_type;
+    total->numa_cpus = s0->numa_cpus;
+    total->numa_cpus_str = s0->numa_cpus_str;
+    total->numa_node = s0->numa_node;
+
+    for (int i = 0; i < run->nb_streams; i++) {
+        BenchContext *s = &run->streams[i];
+        BenchDevice *dev = &run->devices[s->device];
+
+        dev->nb_frames += s->nb_frames;
+        dev->fps += bench_fps(s);
+
+        nb_frames += s->nb_frames;
+        measuring &= s->measuring;
+        total->nb_warmup += s->nb_warmup;
+        total->bytes_copied += s->bytes_copied;
+        total->out_bytes += s->out_bytes;
+        total->out_wait += s->out_wait;
+        total->out.write_time += s->out.write_time;
+        total->out.nb_written += s->out.nb_written;
+        total->in_flight_sum += s->in_flight_sum;
+        total->in_flight_samples += s->in_flight_samples;
+        total->max_in_flight = FFMAX(total->max_in_flight, s->max_in_flight);
+        total->in.io.stats.bytes_read += s->in.io.stats.bytes_read;
+        total->in.io.stats.read_time += s->in.io.stats.read_time;
+        total->in.io.stats.wait_time += s->in.io.stats.wait_time;
+        total->in.io.stats.storage_bytes += s->in.io.stats.storage_bytes;
+        total->in.io.stats.storage_time += s->in.io.stats.storage_time;
+        total->pool_waits += s->pool_waits;
+        total->pool_wait_time += s->pool_wait_time;
+        total->temp_pool_gets += s->temp_pool_gets;
+        total->temp_pool_misses += s->temp_pool_misses;
+        total->allocs.nb_allocs += s->allocs.nb_allocs;
+        total->allocs.bytes += s->allocs.bytes;
+        total->first_frame = FFMAX(total->first_frame, s->first_frame);
+        total->warmup_time = FFMAX(total->warmup_time, s->warmup_time);
+        total->elapsed = FFMAX(total->elapsed, s->elapsed);
+
+        for (int j = 0; j < NB_STAGES; j++)
+            stage_merge(&total->stats[j], &s->stats[j]);
+        stage_merge(&total->latency, &s->latency);
+    }
+
+    total->nb_frames = nb_frames;
+    total->measuring = measuring;
+}
+
+/* Input figures, in MB/s, all zero with FFmpeg's own I/O */
+typedef struct InputSummary {
+    double read_rate;    /* Demanded by the demuxers over the run */
+    double call_rate;    /* While in the read callback */
+    double storage_rate; /* Read-ahead only, while reading from storage */
+    double wait_ms;      /* Read-ahead only, spent waiting for it */
+} InputSummary;
+
+/* Bytes per microsecond are MB/s */
+static void input_summarize(const BenchContext *s, InputSummary *sum)
+{
+    const InputIOStats *io = &s->in.io.stats;
+
+    *sum = (InputSummary) { 0 };
+    if (s->elapsed > 0)
+        sum->read_rate = (double)io->bytes_read / s->elapsed;
+    if (io->read_time)
+        sum->call_rate = (double)io->bytes_read / io->read_time;
+    if (io->storage_time)
+        sum->storage_rate = (double)io->storage_bytes / io->storage_time;
+    sum->wait_ms = io->wait_time / 1000.0;
+}
+
+/* Output figures, all zero if nothing was encoded */
+typedef struct OutputSummary {
+    double bytes_per_frame;
+    double mbps;        /* Bitrate at the input's frame rate */
+    double bytes_per_s; /* Produced by the encoders */
+    double compression; /* Relative to the raw frames */
+    double write_ms;    /* Per packet written */
+} OutputSummary;
+
+static void output_summarize(const BenchContext *s, OutputSummary *sum)
+{
+    int raw = av_image_get_buffer_size(s->enc_fmt, s->in.dec->width,
+                                       s->in.dec->height, 1);
+
+    *sum = (OutputSummary) { 0 };
+    if (!s->nb_frames || !s->out_bytes)
+        return;
+
+    sum->bytes_per_frame = (double)s->out_bytes / s->nb_frames;
+    sum->mbps = sum->bytes_per_frame * 8 * av_q2d(s->frame_rate) / 1e6;
+    if (s->elapsed > 0)
+        sum->bytes_per_s = s->out_bytes / (s->elapsed / 1e6);
+    if (raw > 0)
+        sum->compression = raw / sum->bytes_per_frame;
+    if (s->out.nb_written)
+        sum->write_ms = s->out.write_time / (1000.0 * s->out.nb_written);
+}
+
+static const char *thread_type_name(int type)
+{
+    return type & FF_THREAD_FRAME ? "frame" :
+           type & FF_THREAD_SLICE ? "slice" : "no";
+}
+
+static void print_stats(BenchContext *s)
+{
+    OutputSummary out;
+
+    if (s->first_frame >= 0)
+        printf("First frame: %f ms\n", s->first_frame / 1000.0);
+    StageSummary lat;
+    if (stage_summarize(&s->latency, &lat))
+        printf("Latency: %f ms mean, %f p50, %f p95, %f p99, %f max\n",
+               lat.mean, lat.p50, lat.p95, lat.p99, lat.max);
+    if (s->opts->warmup && s->measuring)
+        printf("Warm-up: %i frames in %f ms\n", s->nb_warmup,
+               s->warmup_time / 1000.0);
+    if (s->conv_path != CONV_NONE) {
+        StageSummary sum;
+        enum BenchStage stage = s->graph ? STAGE_GPU_CONVERT : STAGE_CONVERT;
+        printf("Format: %s to %s, %s on the %s", av_get_pix_fmt_name(s->dec_fmt),
+               av_get_pix_fmt_name(s->enc_fmt), conv_names[s->conv_path],
+               s->graph ? "GPU" : "CPU");
+        if (stage_summarize(&s->stats[stage], &sum))
+            printf(", %f ms per frame", sum.mean);
+        printf("\n");
+    }
+    if (s->stats[STAGE_CONVERT].nb_samples && s->repack.slice)
+        printf("Conversion: %s repack kernels, %i threads\n",
+               s->repack.dsp.name, s->repack.nb_threads + 1);
+    else if (s->stats[STAGE_CONVERT].nb_samples)
+        printf("Conversion: %i threads, flags %s\n",
+               s->opts->sws_threads, s->opts->sws_flags);
+    printf("Decoder: %i threads, %s threading", s->dec_threads,
+           thread_type_name(s->dec_thread_type));
+    if (s->opts->dec_cpus_str)
+        printf(", on CPUs %s", s->opts->dec_cpus_str);
+    printf("\n");
+    if (s->numa_cpus)
+        printf("Placement: NUMA node %i, CPUs %s\n", s->numa_node, s->numa_cpus_str);
+    if (s->hwdec) {
+        if (s->hw_pool_size)
+            printf("Decoder pool: %i frames", s->hw_pool_size);
+        else
+            printf("Decoder pool: growing as needed");
+        printf(", %i waits for a free frame, %f ms waiting\n",
+               atomic_load(&s->pool_waits), atomic_load(&s->pool_wait_time) / 1000.0);
+    }
+    if (s->temp_pool_gets)
+        printf("Staging pool: %u hits, %u misses\n",
+               s->temp_pool_gets - s->temp_pool_misses, s->temp_pool_misses);
+    if (s->nb_frames)
+        printf("Allocations: %.2f per frame, %.1f KiB per frame\n",
+               (double)s->allocs.nb_allocs / s->nb_frames,
+               s->allocs.bytes / 1024.0 / s->nb_frames);
+    if (s->nb_frames && s->up_fmt != AV_PIX_FMT_NONE)
+        printf("Upload (%s): %"PRId64" bytes copied per frame\n",
+               upload_names[s->opts->upload],
+               s->bytes_copied / s->nb_frames);
+
+    InputSummary in;
+    input_summarize(s, &in);
+    if (s->in.io.stats.bytes_read)
+        printf("Input (%s): %.1f MB/s read, %.1f MB/s while reading\n",
+               input_io_names[s->opts->input_io], in.read_rate, in.call_rate);
+    if (s->opts->input_io == INPUT_IO_READAHEAD && s->in.io.stats.storage_bytes)
+        printf("Read-ahead: %.1f MB/s from storage, demuxing waited %f ms\n",
+               in.storage_rate, in.wait_ms);
+
+    if (s->nb_encoders > 1)
+        printf("Parallel encoding: %i encoders, chunks of %i frames\n",
+               s->nb_encoders, s->opts->enc_chunk);
+
+    if (s->in_flight_samples)
+        printf("Encoder: async_depth %i, %.2f frames in flight on average, "
+               "%i at most\n", s->opts->async_depth,
+               (double)s->in_flight_sum / s->in_flight_samples, s->max_in_flight);
+
+    output_summarize(s, &out);
+    if (out.bytes_per_frame)
+        printf("Output: %.0f bytes per frame, %f Mbit/s at %.3f fps, "
+               "compression %.2f:1, %f MB/s produced\n", out.bytes_per_frame,
+               out.mbps, av_q2d(s->frame_rate), out.compression,
+               out.bytes_per_s / 1e6);
+    if (s->out.nb_written)
+        printf("Writer: %f ms per packet, %f ms spent waiting for it\n",
+               out.write_ms, s->out_wait / 1000.0);
+
+    print_stage_stats("stage", s->stats);
+    if (s->gpu_timer)
+        print_gpu_timer_stats(s->gpu_timer, s->nb_frames);
+}
+
+static void json_string(FILE *f, const char *str)
+{
+    if (!str) {
+        fputs("null", f);
+        return;
+    }
+
+    fputc('"', f);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            fprintf(f, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(f, "\\u%04x", *str);
+        else
+            fputc(*str, f);
+    }
+    fputc('"', f);
+}
+
+static void json_stages(FILE *f, const char *name, StageStats *stats)
+{
+    int nb = 0;
+
+    fprintf(f, "  \"%s\": {", name);
+    for (int i = 0; i < NB_STAGES; i++) {
+        StageSummary sum;
+        if (!stage_summarize(&stats[i], &sum))
+            continue;
+
+        fprintf(f, "%s\n    \"%s\": { \"count\": %u, \"min_ms\": %f, "
+                "\"mean_ms\": %f, \"p50_ms\": %f, \"p95_ms\": %f, "
+                "\"p99_ms\": %f, \"max_ms\": %f }",
+                nb++ ? "," : "", stage_keys[i], sum.count, sum.min, sum.mean,
+                sum.p50, sum.p95, sum.p99, sum.max);
+    }
+    fprintf(f, "%s}", nb ? "\n  " : "");
+}
+
+static int write_json(BenchRun *run, const char *path)
+{
+    BenchContext *s = &run->total;
+    OutputSummary out;
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        int err = AVERROR(errno);
+        printf("Error opening %s: %s\n", path, av_err2str(err));
+        return err;
+    }
+
+    fprintf(f, "{\n  \"input\": ");
+    json_string(f, s->opts->input);
+    fprintf(f, ",\n  \"decoder\": ");
+    json_string(f, s->dec_name);
+    fprintf(f, ",\n  \"decode_path\": \"%s\"", s->hwdec ? "hardware" : "software");
+    fprintf(f, ",\n  \"width\": %i,\n  \"height\": %i",
+            s->in.dec->width, s->in.dec->height);
+    fprintf(f, ",\n  \"decoded_format\": ");
+    json_string(f, av_get_pix_fmt_name(s->dec_fmt));
+    fprintf(f, ",\n  \"encoder_format\": ");
+    json_string(f, av_get_pix_fmt_name(s->enc_fmt));
+    fprintf(f, ",\n  \"conversion\": \"%s\"", conv_names[s->conv_path]);
+    fprintf(f, ",\n  \"converter\": \"%s\"", s->converter);
+    fprintf(f, ",\n  \"upload\": \"%s\"", upload_names[s->opts->upload]);
+    fprintf(f, ",\n  \"encoder\": ");
+    json_string(f, s->opts->encode ? s->enc_name : NULL);
+    fprintf(f, ",\n  \"encoder_options\": ");
+    json_string(f, s->enc_opts);
+    fprintf(f, ",\n  \"parallel_encoders\": %i", s->nb_encoders);
+    fprintf(f, ",\n  \"chunk_frames\": %i", s->opts->enc_chunk);
+    fprintf(f, ",\n  \"pipelined\": %s", s->opts->pipeline ? "true" : "false");
+    fprintf(f, ",\n  \"decoder_threads\": %i", s->dec_threads);
+    fprintf(f, ",\n  \"decoder_threading\": \"%s\"", thread_type_name(s->dec_thread_type));
+    fprintf(f, ",\n  \"decoder_cpus\": ");
+    json_string(f, s->opts->dec_cpus_str);
+    fprintf(f, ",\n  \"numa_node\": %i", s->numa_cpus ? s->numa_node : -1);
+    fprintf(f, ",\n  \"decoder_pool_frames\": %i", s->hw_pool_size);
+    fprintf(f, ",\n  \"decoder_pool_waits\": %i", atomic_load(&s->pool_waits));
+    fprintf(f, ",\n  \"decoder_pool_wait_ms\": %f",
+            atomic_load(&s->pool_wait_time) / 1000.0);
+    fprintf(f, ",\n  \"cached_frames\": %i", s->nb_cache);
+    fprintf(f, ",\n  \"streams\": %i", run->nb_streams);
+    fprintf(f, ",\n  \"warmup_frames\": %i", s->nb_warmup);
+    fprintf(f, ",\n  \"warmup_ms\": %f", s->warmup_time / 1000.0);
+    fprintf(f, ",\n  \"first_frame_ms\": ");
+    if (s->first_frame >= 0)
+        fprintf(f, "%f", s->first_frame / 1000.0);
+    else
+        fprintf(f, "null");
+    fprintf(f, ",\n  \"frames\": %i", s->nb_frames);
+    fprintf(f, ",\n  \"time_s\": %f", s->elapsed / 1e6);
+    fprintf(f, ",\n  \"fps\": %f", bench_fps(s));
+    fprintf(f, ",\n  \"bytes_copied_per_frame\": %"PRId64,
+            s->nb_frames ? s->bytes_copied / s->nb_frames : 0);
+    fprintf(f, ",\n  \"peak_rss_mb\": ");
+    if (run->peak_rss >= 0)
+        fprintf(f, "%f", run->peak_rss / 1048576.0);
+    else
+        fprintf(f, "null");
+    fprintf(f, ",\n  \"allocations\": %lli", (long long)s->allocs.nb_allocs);
+    fprintf(f, ",\n  \"allocated_bytes\": %lli", (long long)s->allocs.bytes);
+    fprintf(f, ",\n  \"allocations_per_frame\": %f",
+            (double)s->allocs.nb_allocs / FFMAX(s->nb_frames, 1));
+
+    output_summarize(s, &out);
+    fprintf(f, ",\n  \"output\": ");
+    json_string(f, s->opts->output);
+    fprintf(f, ",\n  \"output_bytes_per_frame\": %f", out.bytes_per_frame);
+    fprintf(f, ",\n  \"output_mbps\": %f", out.mbps);
+    fprintf(f, ",\n  \"output_bytes_per_s\": %f", out.bytes_per_s);
+    fprintf(f, ",\n  \"compression_ratio\": %f", out.compression);
+    fprintf(f, ",\n  \"write_ms_per_packet\": %f", out.write_ms);
+    fprintf(f, ",\n  \"write_wait_ms\": %f", s->out_wait / 1000.0);
+    fprintf(f, ",\n  \"async_depth\": %i", s->opts->async_depth);
+    fprintf(f, ",\n  \"encoder_in_flight_mean\": %f", s->in_flight_samples ?
+            (double)s->in_flight_sum / s->in_flight_samples : 0.0);
+    fprintf(f, ",\n  \"encoder_in_flight_max\": %i", s->max_in_flight);
+
+    InputSummary in;
+    input_summarize(s, &in);
+    fprintf(f, ",\n  \"input_io\": \"%s\"", input_io_names[s->opts->input_io]);
+    fprintf(f, ",\n  \"input_read_mb_s\": %f", in.read_rate);
+    fprintf(f, ",\n  \"input_read_call_mb_s\": %f", in.call_rate);
+    fprintf(f, ",\n  \"storage_read_mb_s\": %f", in.storage_rate);
+    fprintf(f, ",\n  \"input_wait_ms\": %f", in.wait_ms);
+    StageSummary lat;
+    fprintf(f, ",\n  \"latency\": ");
+    if (stage_summarize(&s->latency, &lat))
+        fprintf(f, "{ \"count\": %u, \"min_ms\": %f, \"mean_ms\": %f, "
+                "\"p50_ms\": %f, \"p95_ms\": %f, \"p99_ms\": %f, \"max_ms\": %f }",
+                lat.count, lat.min, lat.mean, lat.p50, lat.p95, lat.p99, lat.max);
+    else
+        fprintf(f, "null");
+    fprintf(f, ",\n");
+    json_stages(f, "stages", s->stats);
+
+    if (s->gpu_timer && s->gpu_timer->nb_intervals) {
+        double utilization, busy = gpu_timer_busy(s->gpu_timer, &utilization);
+        fprintf(f, ",\n");
+        json_stages(f, "gpu_stages", s->gpu_timer->stats);
+        fprintf(f, ",\n  \"gpu_busy_ms_per_frame\": %f",
+                busy / FFMAX(s->nb_frames, 1));
+        fprintf(f, ",\n  \"gpu_utilization\": %f", utilization);
+    }
+
+    fprintf(f, ",\n  \"devices\": [");
+    for (int i = 0; i < run->nb_devices; i++) {
+        BenchDevice *dev = &run->devices[i];
+        fprintf(f, "%s\n    { \"name\": ", i ? "," : "");
+        json_string(f, dev->name);
+        fprintf(f, ", \"pci\": ");
+        json_string(f, dev->pci[0] ? dev->pci : NULL);
+        fprintf(f, ", \"numa_node\": %i, \"cpus\": ", dev->numa_node);
+        json_string(f, dev->numa_cpus_str);
+        fprintf(f, ", \"streams\": %i, \"frames\": %i, \"fps\": %f",
+                dev->nb_streams, dev->nb_frames, dev->fps);
+        if (dev->mem_local >= 0)
+            fprintf(f, ", \"device_local_mb\": %f, \"device_host_mb\": %f",
+                    dev->mem_local / 1048576.0, dev->mem_host / 1048576.0);
+        if (dev->gpu_timer.nb_intervals) {
+            double utilization, busy = gpu_timer_busy(&dev->gpu_timer, &utilization);
+            fprintf(f, ", \"gpu_busy_ms_per_frame\": %f, \"gpu_utilization\": %f",
+                    busy / FFMAX(dev->nb_frames, 1), utilization);
+        }
+        fprintf(f, " }");
+    }
+    fprintf(f, "\n  ]");
+
+    fprintf(f, ",\n  \"per_stream\": [");
+    for (int i = 0; i < run->nb_streams; i++) {
+        const BenchContext *st = &run->streams[i];
+        fprintf(f, "%s\n    { \"device\": %i, \"frames\": %i, \"time_s\": %f, "
+                "\"fps\": %f, \"allocations\": %lli, \"allocated_bytes\": %lli }",
+                i ? "," : "", st->device, st->nb_frames, st->elapsed / 1e6,
+                bench_fps(st), (long long)st->allocs.nb_allocs,
+                (long long)st->allocs.bytes);
+    }
+    fprintf(f, "\n  ]");
+
+    fprintf(f, "\n}\n");
+    fclose(f);
+
+    return 0;
+}
+
+static void csv_string(FILE *f, const char *str)
+{
+    fputc('"', f);
+    for (; str && *str; str++) {
+        if (*str == '"')
+            fputc('"', f);
+        fputc(*str, f);
+    }
+    fputc('"', f);
+}
+
+/* Of the latency and of each stage */
+static const char *const csv_fields[] = { "count", "min_ms", "mean_ms", "p50_ms",
+                                          "p95_ms", "p99_ms", "max_ms" };
+
+static void csv_header(FILE *f)
+{
+    fprintf(f, "input,decoder,decode_path,width,height,decoded_format,"
+               "encoder_format,conversion,converter,upload,encoder,"
+               "encoder_options,parallel_encoders,"
+               "chunk_frames,pipelined,cached_frames,decoder_pool_frames,"
+               "decoder_pool_waits,decoder_pool_wait_ms,streams,devices,"
+               "warmup_frames,warmup_ms,first_frame_ms,frames,"
+               "time_s,fps,bytes_copied_per_frame,output_bytes_per_frame,"
+               "output_mbps,output_bytes_per_s,compression_ratio,"
+               "write_ms_per_packet,write_wait_ms,async_depth,"
+               "encoder_in_flight_mean,encoder_in_flight_max,input_io,"
+               "input_read_mb_s,input_read_call_mb_s,storage_read_mb_s,"
+               "input_wait_ms,decoder_threads,decoder_threading,decoder_cpus,"
+               "numa_node,peak_rss_mb,allocations_per_frame,"
+               "allocated_kib_per_frame,device_local_mb,device_host_mb");
+    for (int j = 0; j < FF_ARRAY_ELEMS(csv_fields); j++)
+        fprintf(f, ",latency_%s", csv_fields[j]);
+    for (int i = 0; i < NB_STAGES; i++)
+        for (int j = 0; j < FF_ARRAY_ELEMS(csv_fields); j++)
+            fprintf(f, ",%s_%s", stage_keys[i], csv_fields[j]);
+    fprintf(f, ",gpu_busy_ms_per_frame,gpu_utilization,stream_fps,device_fps\n");
+}
+
+/* Appends a row, so that nightly runs can accumulate in the same file. The
+ * header is only written if the file is empty, and a file with another header
+ * is left alone. */
+static int write_csv(BenchRun *run, const char *path)
+{
+    BenchContext *s = &run->total;
+    OutputSummary out;
+    double busy = 0.0, utilization = 0.0;
+
+    /* Appending, but reading the header back too */
+    FILE *f = fopen(path, "a+");
+    if (!f) {
+        int err = AVERROR(errno);
+        printf("Error opening %s: %s\n", path, av_err2str(err));
+        return err;
+    }
+
+    /* Rows only line up with the columns of a header just like this one */
+    char *header = NULL, *line = NULL;
+    size_t header_size = 0, line_size = 0;
+    FILE *hf = open_memstream(&header, &header_size);
+    if (!hf) {
+        fclose(f);
+        return AVERROR(ENOMEM);
+    }
+    csv_header(hf);
+    fclose(hf);
+
+    fseek(f, 0, SEEK_END);
+    if (!ftell(f)) {
+        fputs(header, f);
+    } else {
+        rewind(f);
+        int same = getline(&line, &line_size, f) >= 0 && !strcmp(line, header);
+        free(line);
+        if (!same) {
+            printf("Error: %s has other columns than this version writes, "
+                   "not appending to it\n", path);
+            free(header);
+            fclose(f);
+            return AVERROR(EINVAL);
+        }
+        fseek(f, 0, SEEK_END); /* Before writing after reading */
+    }
+    free(header);
+
+    csv_string(f, s->opts->input);
+    fputc(',', f);
+    csv_string(f, s->dec_name);
+    fprintf(f, ",%s,%i,%i,%s,%s,%s,%s,%s,", s->hwdec ? "hardware" : "software",
+            s->in.dec->width, s->in.dec->height,
+            av_get_pix_fmt_name(s->dec_fmt), av_get_pix_fmt_name(s->enc_fmt),
+            conv_names[s->conv_path], s->converter, upload_names[s->opts->upload]);
+    csv_string(f, s->opts->encode ? s->enc_name : NULL);
+    fputc(',', f);
+    csv_string(f, s->enc_opts);
+    fprintf(f, ",%i,%i,%i,%i,%i,%i,%f,%i,%i,%i,%f",
+            s->nb_encoders, s->opts->enc_chunk, s->opts->pipeline, s->nb_cache,
+            s->hw_pool_size, atomic_load(&s->pool_waits),
+            atomic_load(&s->pool_wait_time) / 1000.0, run->nb_streams, run->nb_devices, s->nb_warmup,
+            s->warmup_time / 1000.0);
+    if (s->first_frame >= 0)
+        fprintf(f, ",%f", s->first_frame / 1000.0);
+    else
+        fprintf(f, ",");
+    fprintf(f, ",%i,%f,%f,%"PRId64,
+            s->nb_frames, s->elapsed / 1e6, bench_fps(s),
+            s->nb_frames ? s->bytes_copied / s->nb_frames : 0);
+
+    output_summarize(s, &out);
+    fprintf(f, ",%f,%f,%f,%f,%f,%f", out.bytes_per_frame, out.mbps,
+            out.bytes_per_s, out.compression, out.write_ms, s->out_wait / 1000.0);
+    fprintf(f, ",%i,%f,%i", s->opts->async_depth, s->in_flight_samples ?
+            (double)s->in_flight_sum / s->in_flight_samples : 0.0,
+            s->max_in_flight);
+
+    InputSummary in;
+    input_summarize(s, &in);
+    fprintf(f, ",%s,%f,%f,%f,%f", input_io_names[s->opts->input_io],
+            in.read_rate, in.call_rate, in.storage_rate, in.wait_ms);
+    fprintf(f, ",%i,%s,", s->dec_threads, thread_type_name(s->dec_thread_type));
+    csv_string(f, s->opts->dec_cpus_str);
+    fprintf(f, ",%i", s->numa_cpus ? s->numa_node : -1);
+
+    if (run->peak_rss >= 0)
+        fprintf(f, ",%f", run->peak_rss / 1048576.0);
+    else
+        fprintf(f, ",");
+    fprintf(f, ",%f,%f", (double)s->allocs.nb_allocs / FFMAX(s->nb_frames, 1),
+            s->allocs.bytes / 1024.0 / FFMAX(s->nb_frames, 1));
+
+    /* Over all devices, empty unless all of them could tell */
+    int64_t mem_local = 0, mem_host = 0;
+    int nb_mem = 0;
+    for (; nb_mem < run->nb_devices && run->devices[nb_mem].mem_local >= 0; nb_mem++) {
+        mem_local += run->devices[nb_mem].mem_local;
+        mem_host += run->devices[nb_mem].mem_host;
+    }
+    if (nb_mem == run->nb_devices)
+        fprintf(f, ",%f,%f", mem_local / 1048576.0, mem_host / 1048576.0);
+    else
+        fprintf(f, ",,");
+
+    StageSummary lat;
+    if (stage_summarize(&s->latency, &lat))
+        fprintf(f, ",%u,%f,%f,%f,%f,%f,%f", lat.count, lat.min, lat.mean,
+                lat.p50, lat.p95, lat.p99, lat.max);
+    else
+        fprintf(f, ",,,,,,,");
+
+    for (int i = 0; i < NB_STAGES; i++) {
+        StageSummary sum;
+        if (stage_summarize(&s->stats[i], &sum))
+            fprintf(f, ",%u,%f,%f,%f,%f,%f,%f", sum.count, sum.min, sum.mean,
+                    sum.p50, sum.p95, sum.p99, sum.max);
+        else
+            fprintf(f, ",,,,,,,");
+    }
+
+    if (s->gpu_timer && s->gpu_timer->nb_intervals)
+        busy = gpu_timer_busy(s->gpu_timer, &utilization);
+    fprintf(f, ",%f,%f,\"", busy / FFMAX(s->nb_frames, 1), utilization);
+
+    /* Semicolon-separated, in stream and device order */
+    for (int i = 0; i < run->nb_streams; i++)
+        fprintf(f, "%s%f", i ? ";" : "", bench_fps(&run->streams[i]));
+    fprintf(f, "\",\"");
+    for (int i = 0; i < run->nb_devices; i++)
+        fprintf(f, "%s%f", i ? ";" : "", run->devices[i].fps);
+    fprintf(f, "\"\n");
+
+    fclose(f);
+
+    return 0;
+}
+
+static void print_usage(const char *name)
+{
+    printf("Usage: %s <input> <vulkan device[,device...]> <hwdec 0|1> [encode 0|1] [options]\n"
+           "Options:\n"
+           "    -demux              Decode every packet of the stream rather than\n"
+           "                        the first one repeatedly\n"
+           "    -loop               Rewind to the start of the input at EOF (implies -demux)\n"
+           "    -input-io <mode>    How the input is read (default: default)\n"
+           "                          default: FFmpeg's file I/O\n"
+           "                          mmap: straight out of a mapping of the file\n"
+           "                          readahead: from a buffer a thread reads ahead into\n"
+           "    -readahead <MiB>    Read-ahead buffer size (default: 64)\n"
+           "    -dec-threads <n>    Decoder threads, 0 for one per CPU (default: the\n"
+           "                        libavcodec default)\n"
+           "    -dec-threading <t>  Decoder threading: frame, slice or auto (default:\n"
+           "                        the libavcodec default)\n"
+           "    -dec-cpus <list>    Pin the decoder's threads to CPUs, e.g. 0-3,8\n"
+           "                        (with -pipeline, the decoding thread as well)\n"
+           "    -latency            Measure the latency of each frame, from reading\n"
+           "                        its packet to getting it encoded\n"
+           "    -preset <p>         Set options for, and measure latency with:\n"
+           "                          low-latency: -async-depth 1, no pipelining\n"
+           "                          throughput: -pipeline, -async-depth 3\n"
+           "                        Options after it override it\n"
+           "    -numa               Run each stream's threads on the NUMA node its\n"
+           "                        device is attached to, allocating from it\n"
+           "    -hw-pool <n>        Frames in the hardware decoder's pool (default:\n"
+           "                        what the decoder needs, plus what the stages\n"
+           "                        after it can hold)\n"
+           "    -pipeline           Run decoding, conversion/upload and encoding on\n"
+           "                        separate threads\n"
+           "    -dec-queue <n>      Frames queued between decoding and upload (default: 4)\n"
+           "    -up-queue <n>       Frames queued between upload and encoding (default: 4)\n"
+           "    -upload <mode>      How software frames are uploaded (default: copy)\n"
+           "                          copy: av_hwframe_transfer_data()\n"
+           "                          map: decode or convert straight into mapped frames\n"
+           "                          fused: as map, converting in cache sized bands\n"
+           "                          of rows, timed as part of the upload\n"
+           "    -gpu-convert        Upload frames as decoded, and convert them to the\n"
+           "                        encoder's format on the GPU (hardware decoded\n"
+           "                        frames are whenever the encoder needs it)\n"
+           "    -gpu-filter <f>     Filtergraph to convert with (implies -gpu-convert,\n"
+           "                        default: scale_vulkan=format=<encoder format>)\n"
+           "    -sws-threads <n>    Conversion threads, for swscale and the repack\n"
+           "                        kernels (default: 0, one per CPU)\n"
+           "    -sws-flags <f>      swscale flags (default: fast_bilinear)\n"
+           "    -repack <mode>      What repacks frames on the CPU (default: auto)\n"
+           "                          auto: kernels, with the best SIMD of the CPU\n"
+           "                          c: kernels, in plain C\n"
+           "                          sws: swscale\n"
+           "    -repack-bench       Time the repack kernels against swscale, and\n"
+           "                        check they give the same output, before running\n"
+           "    -gpu-timing         Measure GPU time taken by uploads, conversions\n"
+           "                        and encoding with timestamp queries\n"
+           "    -frames <n>         Frames to measure (default: 1000, or unlimited\n"
+           "                        with -duration)\n"
+           "    -warmup <n>         Frames to run before measuring (default: 0)\n"
+           "    -duration <time>    Measure for a fixed time (e.g. 30s) instead\n"
+           "    -output <file>      Mux the encoded packets into a file, or just count\n"
+           "                        them with null (default: null)\n"
+           "    -output-format <f>  Format to mux in (default: from the file name)\n"
+           "    -async-depth <n>    Frames each encoder keeps in flight (default: 3)\n"
+           "    -cache <n>          Decode n frames once, and loop over them instead\n"
+           "                        of decoding\n"
+           "    -cache-file <file>  Keep the cached frames in a raw file mapped into\n"
+           "                        memory rather than in RAM\n"
+           "    -encoder <name>     Vulkan encoder (e.g. h264_vulkan), or software\n"
+           "                        one (e.g. ffv1) frames get downloaded for\n"
+           "                        (default: ffv1_vulkan)\n"
+           "    -encopt <key=value> Set an encoder option, on top of the defaults\n"
+           "                        (can be repeated)\n"
+           "    -sweep <key=values> Run once with each of a comma-separated list of\n"
+           "                        values of an encoder option, or ranges like 1..8.\n"
+           "                        With several, every combination is run\n"
+           "    -enc-parallel <n>   Encode with n encoders in parallel, each getting\n"
+           "                        chunks of consecutive frames in turn (default: 1)\n"
+           "    -enc-chunk <n>      Frames in each chunk (default: 8)\n"
+           "    -streams <n>        Run n independent decode/upload/encode pipelines\n"
+           "                        at once, spread over the devices in turn\n"
+           "                        (default: one per device)\n"
+           "    -progress <ms>      Interval between progress reports, 0 to only\n"
+           "                        report at the end (default: 500)\n"
+           "    -json <file>        Write the results to a JSON file\n"
+           "    -csv <file>         Append the results to a CSV file\n",
+           name);
+}
+
+/* Sets an encoder option. async_depth also sizes the decoder's pool, so it
+ * is kept apart. */
+static int set_enc_opt(BenchOptions *opts, const char *key, const char *val)
+{
+    if (!strcmp(key, "async_depth")) {
+        char *end;
+        long depth = strtol(val, &end, 10);
+        if (end == val || *end || depth < 1 || depth > INT_MAX) {
+            printf("Invalid async_depth: %s\n", val);
+            return AVERROR(EINVAL);
+        }
+        opts->async_depth = depth;
+        return 0;
+    }
+
+    return av_dict_set(&opts->enc_opts, key, val, 0);
+}
+
+/* Parses key=value, for -encopt and -sweep */
+static int split_key_value(const char *arg, char **key, const char **val)
+{
+    const char *sep = strchr(arg, '=');
+    if (!sep || sep == arg || !sep[1]) {
+        printf("Expected key=value: %s\n", arg);
+        return AVERROR(EINVAL);
+    }
+
+    *key = av_strndup(arg, sep - arg);
+    if (!*key)
+        return AVERROR(ENOMEM);
+    *val = sep + 1;
+
+    return 0;
+}
+
+/* Parses key=v1,v2,... where each value can also be a range of integers,
+ * e.g. async_depth=1..8 */
+static int parse_sweep(BenchOptions *opts, const char *arg)
+{
+    SweepParam *p;
+    char *list, *item, *save = NULL;
+    const char *vals;
+    int err;
+
+    if (opts->nb_sweep == MAX_SWEEP) {
+        printf("Too many swept options, at most %i are supported\n", MAX_SWEEP);
+        return AVERROR(EINVAL);
+    }
+    p = &opts->sweep[opts->nb_sweep++];
+
+    err = split_key_value(arg, &p->key, &vals);
+    if (err < 0)
+        return err;
+
+    list = av_strdup(vals);
+    if (!list)
+        return AVERROR(ENOMEM);
+
+    for (item = av_strtok(list, ",", &save); item;
+         item = av_strtok(NULL, ",", &save)) {
+        int lo = 0, hi = 0, len = 0;
+        int range = sscanf(item, "%d..%d%n", &lo, &hi, &len) == 2 && !item[len];
+        if (!range) {
+            lo = hi = 0;
+        } else if (hi < lo || hi - lo > 1000) {
+            printf("Invalid range for %s: %s\n", p->key, item);
+            err = AVERROR(EINVAL);
+            break;
+        }
+
+        for (int64_t v = lo; v <= hi; v++) {
+            char *val = range ? av_asprintf("%"PRId64, v) : av_strdup(item);
+            if (!val) {
+                err = AVERROR(ENOMEM);
+                break;
+            }
+            av_dynarray_add(&p->values, &p->nb_values, val);
+            if (!p->values) {
+                av_free(val);
+                err = AVERROR(ENOMEM);
+                break;
+            }
+        }
+        if (err < 0)
+            break;
+    }
+    av_free(list);
+
+    if (err >= 0 && !p->nb_values) {
+        printf("No values to sweep %s over\n", p->key);
+        err = AVERROR(EINVAL);
+    }
+
+    return err;
+}
+
+static void free_options(BenchOptions *opts)
+{
+    av_dict_free(&opts->enc_opts);
+    for (int i = 0; i < opts->nb_sweep; i++) {
+        SweepParam *p = &opts->sweep[i];
+        for (int j = 0; j < p->nb_values; j++)
+            av_free(p->values[j]);
+        av_freep(&p->values);
+        av_freep(&p->key);
+    }
+}
+
+/* Parses the argument of option argv[*i] as an integer no lower than min */
+static int parse_int_arg(int argc, const char **argv, int *i, int min, int *dst)
+{
+    char *end;
+    long val;
+
+    if (*i + 1 >= argc) {
+        printf("Missing argument for %s\n", argv[*i]);
+        return AVERROR(EINVAL);
+    }
+
+    val = strtol(argv[*i + 1], &end, 10);
+    if (end == argv[*i + 1] || *end || val < min || val > INT_MAX) {
+        printf("Invalid argument for %s: %s\n", argv[*i], argv[*i + 1]);
+        return AVERROR(EINVAL);
+    }
+
+    *dst = val;
+    (*i)++;
+
+    return 0;
+}
+
+static int parse_options(BenchOptions *opts, int argc, const char **argv)
+{
+    int err = 0;
+    const char *args[4] = { NULL };
+    int nb_args = 0;
+
+    opts->readahead = 64;
+    opts->dec_threads = -1;
+    opts->dec_queue = 4;
+    opts->up_queue = 4;
+    opts->sws_flags = "fast_bilinear";
+    opts->progress = 500;
+    opts->encoder = "ffv1_vulkan";
+    opts->async_depth = 3;
+    opts->enc_parallel = 1;
+    opts->enc_chunk = 8;
+
+    for (int i = 1; i < argc; i++) {
+        const char *opt = argv[i];
+
+        if (opt[0] != '-' || !opt[1]) {
+            if (nb_args == FF_ARRAY_ELEMS(args)) {
+                printf("Unexpected argument: %s\n", opt);
+                return AVERROR(EINVAL);
+            }
+            args[nb_args++] = opt;
+            continue;
+        }
+
+        /* Both -opt and --opt are accepted */
+        opt += 1 + (opt[1] == '-');
+
+        if (!strcmp(opt, "demux")) {
+            opts->demux = 1;
+        } else if (!strcmp(opt, "loop")) {
+            opts->demux = 1;
+            opts->loop = 1;
+        } else if (!strcmp(opt, "input-io") && i + 1 < argc) {
+            const char *mode = argv[++i];
+            int j;
+            for (j = 0; j < FF_ARRAY_ELEMS(input_io_names); j++)
+                if (!strcmp(mode, input_io_names[j]))
+                    break;
+            if (j == FF_ARRAY_ELEMS(input_io_names)) {
+                printf("Unknown input I/O mode: %s\n", mode);
+                return AVERROR(EINVAL);
+            }
+            opts->input_io = j;
+        } else if (!strcmp(opt, "repack") && i + 1 < argc) {
+            const char *mode = argv[++i];
+            int j;
+            for (j = 0; j < FF_ARRAY_ELEMS(repack_names); j++)
+                if (!strcmp(mode, repack_names[j]))
+                    break;
+            if (j == FF_ARRAY_ELEMS(repack_names)) {
+                printf("Unknown repack mode: %s\n", mode);
+                return AVERROR(EINVAL);
+            }
+            opts->repack = j;
+        } else if (!strcmp(opt, "repack-bench")) {
+            opts->repack_bench = 1;
+        } else if (!strcmp(opt, "readahead")) {
+            err = parse_int_arg(argc, argv, &i, 1, &opts->readahead);
+        } else if (!strcmp(opt, "dec-threads")) {
+            err = parse_int_arg(argc, argv, &i, 0, &opts->dec_threads);
+        } else if (!strcmp(opt, "dec-threading") && i + 1 < argc) {
+            const char *type = argv[++i];
+            if (!strcmp(type, "frame")) {
+                opts->dec_thread_type = FF_THREAD_FRAME;
+            } else if (!strcmp(type, "slice")) {
+                opts->dec_thread_type = FF_THREAD_SLICE;
+            } else if (!strcmp(type, "auto")) {
+                opts->dec_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+            } else {
+                printf("Unknown decoder threading: %s\n", type);
+                return AVERROR(EINVAL);
+            }
+        } else if (!strcmp(opt, "dec-cpus") && i + 1 < argc) {
+            opts->dec_cpus_str = argv[++i];
+            err = parse_cpu_list(opts->dec_cpus_str, &opts->dec_cpus);
+        } else if (!strcmp(opt, "latency")) {
+            opts->latency = 1;
+        } else if (!strcmp(opt, "preset") && i + 1 < argc) {
+            const char *preset = argv[++i];
+            opts->latency = 1;
+            if (!strcmp(preset, "low-latency")) {
+                /* Each frame goes all the way through before the next */
+                opts->pipeline = 0;
+                opts->async_depth = 1;
+                opts->enc_parallel = 1;
+                opts->dec_queue = opts->up_queue = 1;
+            } else if (!strcmp(preset, "throughput")) {
+                opts->pipeline = 1;
+                opts->async_depth = 3;
+                opts->dec_queue = opts->up_queue = 4;
+            } else {
+                printf("Unknown preset: %s\n", preset);
+                return AVERROR(EINVAL);
+            }
+        } else if (!strcmp(opt, "numa")) {
+            opts->numa = 1;
+        } else if (!strcmp(opt, "hw-pool")) {
+            err = parse_int_arg(argc, argv, &i, 1, &opts->hw_pool);
+        } else if (!strcmp(opt, "pipeline")) {
+            opts->pipeline = 1;
+        } else if (!strcmp(opt, "dec-queue")) {
+            err = parse_int_arg(argc, argv, &i, 1, &opts->dec_queue);
+        } else if (!strcmp(opt, "up-queue")) {
+            err = parse_int_arg(argc, argv, &i, 1, &opts->up_queue);
+        } else if (!strcmp(opt, "sws-threads")) {
+            err = parse_int_arg(argc, argv, &i, 0, &opts->sws_threads);
+        } else if (!strcmp(opt, "sws-flags") && i + 1 < argc) {
+            opts->sws_flags = argv[++i];
+        } else if (!strcmp(opt, "frames")) {
+            err = parse_int_arg(argc, argv, &i, 1, &opts->frames);
+        } else if (!strcmp(opt, "warmup")) {
+            err = parse_int_arg(argc, argv, &i, 0, &opts->warmup);
+        } else if (!strcmp(opt, "duration") && i + 1 < argc) {
+            err = av_parse_time(&opts->duration, argv[++i], 1);
+            if (err < 0 || opts->duration <= 0) {
+                printf("Invalid duration: %s\n", argv[i]);
+                return AVERROR(EINVAL);
+            }
+        } else if (!strcmp(opt, "output") && i + 1 < argc) {
+            opts->output = argv[++i];
+        } else if (!strcmp(opt, "output-format") && i + 1 < argc) {
+            opts->output_format = argv[++i];
+        } else if (!strcmp(opt, "async-depth")) {
+            err = parse_int_arg(argc, argv, &i, 1, &opts->async_depth);
+        } else if (!strcmp(opt, "cache")) {
+            err = parse_int_arg(argc, argv, &i, 1, &opts->cache);
+        } else if (!strcmp(opt, "cache-file") && i + 1 < argc) {
+            opts->cache_file = argv[++i];
+        } else if (!strcmp(opt, "encoder") && i + 1 < argc) {
+            opts->encoder = argv[++i];
+        } else if (!strcmp(opt, "encopt") && i + 1 < argc) {
+            char *key;
+            const char *val;
+            err = split_key_value(argv[++i], &key, &val);
+            if (err < 0)
+                return err;
+            err = set_enc_opt(opts, key, val);
+            av_free(key);
+        } else if (!strcmp(opt, "sweep") && i + 1 < argc) {
+            err = parse_sweep(opts, argv[++i]);
+        } else if (!strcmp(opt, "enc-parallel")) {
+            err = parse_int_arg(argc, argv, &i, 1, &opts->enc_parallel);
+        } else if (!strcmp(opt, "enc-chunk")) {
+            err = parse_int_arg(argc, argv, &i, 1, &opts->enc_chunk);
+        } else if (!strcmp(opt, "streams")) {
+            err = parse_int_arg(argc, argv, &i, 1, &opts->streams);
+        } else if (!strcmp(opt, "progress")) {
+            err = parse_int_arg(argc, argv, &i, 0, &opts->progress);
+        } else if (!strcmp(opt, "json") && i + 1 < argc) {
+            opts->json_path = argv[++i];
+        } else if (!strcmp(opt, "csv") && i + 1 < argc) {
+            opts->csv_path = argv[++i];
+        } else if (!strcmp(opt, "gpu-timing")) {
+            opts->gpu_timing = 1;
+        } else if (!strcmp(opt, "gpu-convert")) {
+            opts->gpu_convert = 1;
+        } else if (!strcmp(opt, "gpu-filter") && i + 1 < argc) {
+            opts->gpu_convert = 1;
+            opts->gpu_filter = argv[++i];
+        } else if (!strcmp(opt, "upload") && i + 1 < argc) {
+            const char *mode = argv[++i];
+            int j;
+            for (j = 0; j < FF_ARRAY_ELEMS(upload_names); j++)
+                if (!strcmp(mode, upload_names[j]))
+                    break;
+            if (j == FF_ARRAY_ELEMS(upload_names)) {
+                printf("Unknown upload mode: %s\n", mode);
+                return AVERROR(EINVAL);
+            }
+            opts->upload = j;
+        } else {
+            printf("Unknown option: %s\n", argv[i]);
+            return AVERROR(EINVAL);
+        }
+
+        if (err < 0)
+            return err;
+    }
+
+    if (nb_args < 3)
+        return AVERROR(EINVAL);
+
+    opts->input  = args[0];
+    opts->device = args[1];
+    opts->hwdec  = !strcmp(args[2], "1");
+    opts->encode = args[3] && !strcmp(args[3], "1");
+
+    return 0;
+}
+
+/* Names the files of all but the first of several streams or runs:
+ * out.mkv, out-1.mkv, out-2.mkv... */
+static char *indexed_path(const char *path, int index)
+{
+    const char *ext = strrchr(path, '.');
+    int len = ext && !strchr(ext, '/') ? ext - path : strlen(path);
+
+    if (!index)
+        return av_strdup(path);
+
+    return av_asprintf("%.*s-%i%s", len, path, index, path + len);
+}
+
+/* The mapping outlives the frames, and is unmapped by bench_uninit() */
+static void cache_buffer_free(void *opaque, uint8_t *data)
+{
+}
+
+/* Writes a frame to the cache file, keeping its properties in cached */
+static int cache_write_frame(BenchContext *s, int fd, uint8_t *buf, int size,
+                             const AVFrame *frame, AVFrame *cached)
+{
+    const AVFrame *first = s->nb_cache ? s->cache[0] : frame;
+    int err;
+
+    if (frame->format != first->format || frame->width != first->width ||
+        frame->height != first->height) {
+        printf("Frames of different formats or sizes can not be cached in a file\n");
+        return AVERROR(ENOSYS);
+    }
+
+    err = av_image_copy_to_buffer(buf, size, (const uint8_t * const *)frame->data,
+                                  frame->linesize, frame->format, frame->width,
+                                  frame->height, TEMP_ALIGN);
+    if (err < 0)
+        return err;
+
+    if (write(fd, buf, size) != size) {
+        err = errno ? AVERROR(errno) : AVERROR(EIO);
+        printf("Error writing cache file: %s\n", av_err2str(err));
+        return err;
+    }
+
+    err = av_frame_copy_props(cached, frame);
+    cached->format = frame->format;
+    cached->width  = frame->width;
+    cached->height = frame->height;
+
+    return err;
+}
+
+/* Points the cached frames into the mapped file */
+static int cache_map_frames(BenchContext *s, int fd, int size)
+{
+    s->cache_map_size = (size_t)size * s->nb_cache;
+    s->cache_map = mmap(NULL, s->cache_map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (s->cache_map == MAP_FAILED) {
+        int err = AVERROR(errno);
+        s->cache_map = NULL;
+        printf("Error mapping cache file: %s\n", av_err2str(err));
+        return err;
+    }
+
+    for (int i = 0; i < s->nb_cache; i++) {
+        AVFrame *frame = s->cache[i];
+        int err;
+
+        frame->buf[0] = av_buffer_create(s->cache_map + (size_t)size * i, size,
+                                         cache_buffer_free, NULL,
+                                         AV_BUFFER_FLAG_READONLY);
+        if (!frame->buf[0])
+            return AVERROR(ENOMEM);
+
+        err = av_image_fill_arrays(frame->data, frame->linesize,
+                                   frame->buf[0]->data, frame->format,
+                                   frame->width, frame->height, TEMP_ALIGN);
+        if (err < 0)
+            return err;
+    }
+
+    return 0;
+}
+
+/* Decodes up to opts->cache frames once, so that the stages after decoding
+ * can be measured on their own. With a cache file, frames are written out as
+ * they are decoded and mapped back afterwards, so that the cache does not
+ * have to fit in RAM as well. Each stream gets a file of its own. */
+static int fill_cache(BenchContext *s, int index)
+{
+    const BenchOptions *opts = s->opts;
+    uint8_t *buf = NULL;
+    char *path = NULL;
+    int err = 0, size = 0, fd = -1;
+
+    s->cache = av_calloc(opts->cache, sizeof(*s->cache));
+    if (!s->cache)
+        return AVERROR(ENOMEM);
+
+    if (opts->cache_file) {
+        path = indexed_path(opts->cache_file, index);
+        if (!path)
+            return AVERROR(ENOMEM);
+
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            err = AVERROR(errno);
+            printf("Error opening %s: %s\n", path, av_err2str(err));
+            av_free(path);
+            return err;
+        }
+    }
+
+    AVFrame *frame = av_frame_alloc();
+    if (!frame) {
+        err = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    while (s->nb_cache < opts->cache) {
+        err = decode_frame(&s->in, frame);
+        if (err == AVERROR_EOF) {
+            err = 0;
+            break;
+        } else if (err < 0) {
+            printf("Error decoding frame: %s\n", av_err2str(err));
+            goto end;
+        }
+
+        if (fd < 0) {
+            s->cache[s->nb_cache++] = frame;
+            frame = av_frame_alloc();
+            if (!frame) {
+                err = AVERROR(ENOMEM);
+                goto end;
+            }
+            continue;
+        }
+
+        if (frame->hw_frames_ctx) {
+            printf("Hardware frames can not be cached in a file\n");
+            err = AVERROR(EINVAL);
+            goto end;
+        }
+
+        if (!buf) {
+            size = av_image_get_buffer_size(frame->format, frame->width,
+                                            frame->height, TEMP_ALIGN);
+            buf = size > 0 ? av_malloc(size) : NULL;
+            if (!buf) {
+                err = size < 0 ? size : AVERROR(ENOMEM);
+                goto end;
+            }
+        }
+
+        AVFrame *cached = av_frame_alloc();
+        if (!cached) {
+            err = AVERROR(ENOMEM);
+            goto end;
+        }
+        err = cache_write_frame(s, fd, buf, size, frame, cached);
+        av_frame_unref(frame);
+        if (err < 0) {
+            av_frame_free(&cached);
+            goto end;
+        }
+        s->cache[s->nb_cache++] = cached;
+    }
+
+    if (!s->nb_cache) {
+        printf("No frames to cache\n");
+        err = AVERROR(EINVAL);
+        goto end;
+    }
+
+    if (fd >= 0)
+        err = cache_map_frames(s, fd, size);
+
+    if (err >= 0 && !index)
+        printf("Cached %i decoded frames%s%s\n", s->nb_cache,
+               path ? " in " : "", path ? path : "");
+
+end:
+    av_frame_free(&frame);
+    av_free(buf);
+    av_free(path);
+    if (fd >= 0)
+        close(fd);
+    return err;
+}
+
+static int init_encoder(BenchContext *s, Encoder *e, const AVCodec *codec,
+                        AVBufferRef *hwfc_ref, AVBufferRef *hw_dev_ref)
 {
-    int ret = 0;
+    int err;
+    AVCodecContext *avctx;
+
+    e->s = s;
+    e->pkt = av_packet_alloc();
+    e->avctx = avctx = avcodec_alloc_context3(codec);
+    if (!e->pkt || !avctx)
+        return AVERROR(ENOMEM);
 
-    ret = avcodec_send_packet(dec, pkt);
-    if (ret < 0) {
-        fprintf(stderr, "Error submitting a packet for decoding (%s)\n",
-                av_err2str(ret));
-        return ret;
+    avctx->time_base = av_inv_q(s->frame_rate);
+    avctx->framerate = s->frame_rate;
+    avctx->width = s->in.dec->width;
+    avctx->height = s->in.dec->height;
+    if (s->sw_encode) {
+        avctx->pix_fmt = s->up_fmt;
+    } else {
+        avctx->sw_pix_fmt = ((AVHWFramesContext *)hwfc_ref->data)->sw_format;
+        avctx->pix_fmt = AV_PIX_FMT_VULKAN;
+        avctx->hw_frames_ctx = av_buffer_ref(hwfc_ref);
+        avctx->hw_device_ctx = av_buffer_ref(hw_dev_ref);
+        if (!avctx->hw_frames_ctx || !avctx->hw_device_ctx)
+            return AVERROR(ENOMEM);
     }
 
-    ret = avcodec_receive_frame(dec, frame);
-    return ret;
+    AVDictionary *enc_opts = NULL;
+    if (codec->id == AV_CODEC_ID_FFV1)
+        av_dict_set(&enc_opts, "level", "3", 0);
+    /* Software encoders get slice or frame threads, as they support */
+    if (s->sw_encode)
+        av_dict_set(&enc_opts, "threads", "auto", 0);
+    else
+        av_dict_set_int(&enc_opts, "async_depth", s->opts->async_depth, 0);
+    av_dict_copy(&enc_opts, s->opts->enc_opts, 0);
+    /* Opening the encoder consumes the dictionary */
+    if (!s->enc_opts)
+        av_dict_get_string(enc_opts, &s->enc_opts, '=', ',');
+    err = avcodec_open2(avctx, codec, &enc_opts);
+    av_dict_free(&enc_opts);
+    if (err < 0) {
+        printf("Error initializing encoder: %s\n", av_err2str(err));
+        return err;
+    }
+
+    return 0;
 }
 
-static enum AVPixelFormat remap_pixfmt(enum AVPixelFormat fmt)
-{
-    switch (fmt) {
-    case AV_PIX_FMT_YUV420P:
-        return AV_PIX_FMT_NV12;
-    case AV_PIX_FMT_GBRAP16:
-        return AV_PIX_FMT_RGBA64;
-    case AV_PIX_FMT_GBRP10:
-        return AV_PIX_FMT_X2BGR10;
-    case AV_PIX_FMT_RGB48LE:
-    case AV_PIX_FMT_RGB48BE:
-        return AV_PIX_FMT_GBRP16;
-    case AV_PIX_FMT_BGR0:
-        return AV_PIX_FMT_RGB0;
-    default:
-        return fmt;
-    };
+#define REPACK_BENCH_RUNS 50
+
+/* Times the repack kernels against swscale on a frame of noise, and checks
+ * they give the same samples */
+static int repack_bench(BenchContext *s, int width, int height)
+{
+    RepackContext *r = &s->repack;
+    const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get(r->from);
+    const AVPixFmtDescriptor *dst_desc = av_pix_fmt_desc_get(r->to);
+    RepackDSP dsp = r->dsp, dsps[2];
+    AVFrame *src = av_frame_alloc();
+    AVFrame *ref = av_frame_alloc();
+    AVFrame *dst = av_frame_alloc();
+    uint16_t *line = av_malloc_array(2 * width, sizeof(*line));
+    uint32_t seed = 1;
+    int64_t start, bytes;
+    int err = AVERROR(ENOMEM);
+
+    if (!src || !ref || !dst || !line)
+        goto end;
+
+    src->format = r->from;
+    ref->format = dst->format = r->to;
+    src->width  = ref->width  = dst->width  = width;
+    src->height = ref->height = dst->height = height;
+    if ((err = av_frame_get_buffer(src, 0)) < 0 ||
+        (err = av_frame_get_buffer(ref, 0)) < 0 ||
+        (err = av_frame_get_buffer(dst, 0)) < 0)
+        goto end;
+
+    /* Noise within the depth of each component */
+    for (int c = 0; c < src_desc->nb_components; c++) {
+        int chroma = c == 1 || c == 2;
+        int w = AV_CEIL_RSHIFT(width, chroma ? src_desc->log2_chroma_w : 0);
+        int h = AV_CEIL_RSHIFT(height, chroma ? src_desc->log2_chroma_h : 0);
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                seed = seed * 1664525 + 1013904223;
+                line[x] = (seed >> 16) & ((1 << src_desc->comp[c].depth) - 1);
+            }
+            av_write_image_line2(line, src->data, src->linesize, src_desc,
+                                 0, y, c, w, 2);
+        }
+    }
+
+    bytes = (frame_bytes(src) + frame_bytes(dst)) * REPACK_BENCH_RUNS;
+    printf("Repacking %s to %s, %ix%i, %i threads:\n",
+           av_get_pix_fmt_name(r->from), av_get_pix_fmt_name(r->to),
+           width, height, r->nb_threads + 1);
+
+    start = av_gettime_relative();
+    for (int i = 0; i < REPACK_BENCH_RUNS; i++) {
+        err = sws_scale_frame(s->swc, ref, src);
+        if (err < 0) {
+            printf("Error scaling frame: %s\n", av_err2str(err));
+            goto end;
+        }
+    }
+    start = FFMAX(av_gettime_relative() - start, 1);
+    printf("    %-8s %f ms per frame, %.2f GB/s\n", "swscale",
+           start / 1000.0 / REPACK_BENCH_RUNS, bytes / (start * 1000.0));
+
+    repack_dsp_init(&dsps[0], 0);
+    repack_dsp_init(&dsps[1], av_get_cpu_flags());
+    for (int i = 0; i < 2; i++) {
+        int max_diff = 0;
+
+        /* Without SIMD for the CPU, both are the C kernels */
+        if (i && !strcmp(dsps[i].name, dsps[0].name))
+            break;
+
+        r->dsp = dsps[i];
+        start = av_gettime_relative();
+        for (int j = 0; j < REPACK_BENCH_RUNS; j++)
+            repack_frame(r, dst, src, 0);
+        start = FFMAX(av_gettime_relative() - start, 1);
+
+        /* Compared by component, as padding bits are left undefined */
+        for (int c = 0; c < dst_desc->nb_components; c++) {
+            int chroma = c == 1 || c == 2;
+            int w = AV_CEIL_RSHIFT(width, chroma ? dst_desc->log2_chroma_w : 0);
+            int h = AV_CEIL_RSHIFT(height, chroma ? dst_desc->log2_chroma_h : 0);
+            for (int y = 0; y < h; y++) {
+                av_read_image_line2(line, (const uint8_t **)ref->data, ref->linesize,
+                                    dst_desc, 0, y, c, w, 0, 2);
+                av_read_image_line2(line + width, (const uint8_t **)dst->data,
+                                    dst->linesize, dst_desc, 0, y, c, w, 0, 2);
+                for (int x = 0; x < w; x++)
+                    max_diff = FFMAX(max_diff, abs(line[x] - line[width + x]));
+            }
+        }
+
+        printf("    %-8s %f ms per frame, %.2f GB/s, ", dsps[i].name,
+               start / 1000.0 / REPACK_BENCH_RUNS, bytes / (start * 1000.0));
+        if (max_diff)
+            printf("off from swscale by up to %i\n", max_diff);
+        else
+            printf("same as swscale\n");
+    }
+    err = 0;
+
+end:
+    r->dsp = dsp;
+    av_frame_free(&src);
+    av_frame_free(&ref);
+    av_frame_free(&dst);
+    av_free(line);
+    return err;
 }
 
-int main(int argc, const char **argv)
+/* Sets up one stream: its own demuxer, decoder, frames contexts and encoder
+ * on the shared device. Only the first stream prints what it is doing. */
+static int bench_init(BenchContext *s, const BenchOptions *opts,
+                      AVBufferRef *hw_dev_ref, GPUTimer *gpu_timer, int index)
 {
     int err;
-    av_log_set_level(AV_LOG_VERBOSE);
+    int verbose = !index;
+    int nb_encoders = opts->encode ? opts->enc_parallel : 1;
+
+    *s = (BenchContext) {
+        .opts      = opts,
+        .up_fmt    = AV_PIX_FMT_NONE,
+        .gpu_timer = gpu_timer,
+        .in.io.fd  = -1,
+        .out.fd    = -1,
+    };
 
-    AVFormatContext *in_ctx = avformat_alloc_context();
-    err = avformat_open_input(&in_ctx, argv[1], NULL, NULL);
+    /* The encoder decides what the frames have to be turned into */
+    const AVCodec *out_enc = avcodec_find_encoder_by_name(opts->encoder);
+    if (!out_enc) {
+        printf("Encoder %s not found\n", opts->encoder);
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+
+    int vulkan_enc = encoder_is_vulkan(out_enc);
+    if (!vulkan_enc && (opts->upload != UPLOAD_COPY || opts->gpu_convert)) {
+        printf("-upload map and -gpu-convert need a Vulkan encoder\n");
+        return AVERROR(EINVAL);
+    }
+    s->sw_encode = !vulkan_enc;
+
+    AVFormatContext *in_ctx = NULL;
+    if (opts->input_io != INPUT_IO_DEFAULT) {
+        err = input_io_open(&s->in.io, opts->input, opts->input_io,
+                            (size_t)opts->readahead << 20, &s->measuring);
+        if (err < 0)
+            return err;
+
+        in_ctx = avformat_alloc_context();
+        if (!in_ctx)
+            return AVERROR(ENOMEM);
+        in_ctx->pb = s->in.io.pb;
+        in_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+
+    err = avformat_open_input(&in_ctx, opts->input, NULL, NULL);
     if (err < 0) {
-        printf("Error opening input file: %s\n", argv[1]);
-        return AVERROR(err);
+        printf("Error opening input file: %s\n", opts->input);
+        return err;
     }
+    s->in.fmt_ctx = in_ctx;
 
     const AVCodec *in_dec;
     int sid = err = av_find_best_stream(in_ctx, AVMEDIA_TYPE_VIDEO, -1, -1,
                                         &in_dec, 0);
     if (err < 0) {
-        printf("Error finding stream for file: %s\n", argv[1]);
-        return AVERROR(err);
+        printf("Error finding stream for file: %s\n", opts->input);
+        return err;
     }
 
     AVCodecContext *in_avctx = avcodec_alloc_context3(in_dec);
-    if (err < 0) {
-        printf("Error opening decoder: %s\n", av_err2str(err));
-        return AVERROR(err);
-    }
+    if (!in_avctx)
+        return AVERROR(ENOMEM);
+    s->in.dec = in_avctx;
 
     err = avcodec_parameters_to_context(in_avctx, in_ctx->streams[sid]->codecpar);
     if (err < 0) {
         printf("Error using codec parameters: %s\n", av_err2str(err));
-        return AVERROR(err);
+        return err;
     }
 
-    AVBufferRef *hw_dev_ref;
-    err = av_hwdevice_ctx_create(&hw_dev_ref, AV_HWDEVICE_TYPE_VULKAN,
-                                 argv[2], NULL, 0);
-    if (err < 0) {
-        printf("Error creating device: %s\n", av_err2str(err));
-        return AVERROR(err);
+    int hw_config = 0;
+    for (int i = 0; opts->hwdec && !hw_config; i++) {
+        const AVCodecHWConfig *cfg = avcodec_get_hw_config(in_dec, i);
+        if (!cfg)
+            break;
+        hw_config = cfg->device_type == AV_HWDEVICE_TYPE_VULKAN &&
+                    (cfg->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX);
     }
+    if (opts->hwdec && !hw_config && verbose)
+        printf("No Vulkan decoding for %s, decoding in software\n", in_dec->name);
 
-    if (!strcmp(argv[3], "1"))
-        in_avctx->hw_device_ctx = hw_dev_ref;
+    in_avctx->opaque = s;
+    if (hw_config) {
+        in_avctx->hw_device_ctx = av_buffer_ref(hw_dev_ref);
+        if (!in_avctx->hw_device_ctx)
+            return AVERROR(ENOMEM);
+        /* Frames sitting in the queues, in flight in the encoders or in the
+         * cache must not starve the decoder */
+        s->hw_pool_extra = downstream_frames(opts, nb_encoders);
+        in_avctx->get_format = hw_get_format;
+        in_avctx->get_buffer2 = hw_get_buffer;
+    }
+
+    AVPacket *pkt = av_packet_alloc();
+    if (!pkt)
+        return AVERROR(ENOMEM);
+
+    s->in.sid   = sid;
+    s->in.demux = opts->demux;
+    s->in.loop  = opts->loop;
+    s->in.pkt   = pkt;
+
+    if (opts->upload != UPLOAD_COPY && !hw_config &&
+        (in_dec->capabilities & AV_CODEC_CAP_DR1))
+        in_avctx->get_buffer2 = map_get_buffer;
+
+    if (opts->latency) {
+        in_avctx->flags |= AV_CODEC_FLAG_COPY_OPAQUE;
+        s->in.stamps = av_buffer_pool_init(sizeof(int64_t), NULL);
+        if (!s->in.stamps)
+            return AVERROR(ENOMEM);
+    }
+
+    if (opts->dec_threads >= 0)
+        in_avctx->thread_count = opts->dec_threads;
+    if (opts->dec_thread_type)
+        in_avctx->thread_type = opts->dec_thread_type;
+
+    /* The decoder's threads are started when opening it, and inherit the
+     * affinity of this thread, which is only pinned for the duration */
+    cpu_set_t cpus;
+    if (opts->dec_cpus_str) {
+        err = pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (!err)
+            err = pthread_setaffinity_np(pthread_self(), sizeof(opts->dec_cpus),
+                                         &opts->dec_cpus);
+        if (err) {
+            printf("Error pinning decoder threads: %s\n", av_err2str(AVERROR(err)));
+            return AVERROR(err);
+        }
+    }
 
     err = avcodec_open2(in_avctx, in_dec, NULL);
+    if (opts->dec_cpus_str)
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
     if (err < 0) {
         printf("Error opening decoder: %s\n", av_err2str(err));
-        return AVERROR(err);
+        return err;
     }
+    s->dec_threads = in_avctx->thread_count;
+    s->dec_thread_type = in_avctx->active_thread_type;
 
-    av_dump_format(in_ctx, 0, argv[1], 0);
-
-    AVPacket *pkt = av_packet_alloc();
-    if (!pkt)
-        return ENOMEM;
+    if (verbose)
+        av_dump_format(in_ctx, 0, opts->input, 0);
 
-    err = av_read_frame(in_ctx, pkt);
-    if (err < 0) {
-        printf("Error reading packet: %s\n", av_err2str(err));
-        return AVERROR(err);
+    /* Without demuxing, this packet gets decoded over and over again */
+    if (!opts->demux) {
+        err = read_packet(in_ctx, sid, 0, pkt);
+        if (err < 0) {
+            printf("Error reading packet: %s\n", av_err2str(err));
+            return err;
+        }
+        s->in.pkt_pending = 1;
     }
 
     /* Probe */
     AVFrame *frame = av_frame_alloc();
-    err = decode_frame(in_avctx, pkt, frame);
+    if (!frame)
+        return AVERROR(ENOMEM);
+    err = decode_frame(&s->in, frame);
+    av_frame_free(&frame);
     if (err < 0) {
         printf("Error decoding frame: %s\n", av_err2str(err));
-        return AVERROR(err);
+        return err;
+    }
+
+    if (opts->cache) {
+        err = fill_cache(s, index);
+        if (err < 0)
+            return err;
     }
-    av_frame_unref(frame);
 
     /* Frame context */
     AVBufferRef *hwfc_ref = NULL;
     const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(in_avctx->pix_fmt);
-    if (!(desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
-        printf("Software decoding\n");
-        printf("Creating frame context to upload hardware frames into\n");
+    int hwdec = !!(desc->flags & AV_PIX_FMT_FLAG_HWACCEL);
+    if (s->sw_encode) {
+        enum AVPixelFormat dec_fmt = hwdec ? in_avctx->sw_pix_fmt : in_avctx->pix_fmt;
+        s->up_fmt = negotiate_format(out_enc, 0, hw_dev_ref, dec_fmt, &s->conv_path);
+        if (s->up_fmt == AV_PIX_FMT_NONE)
+            return AVERROR(ENOSYS);
+        if (verbose)
+            printf("%s decoding, encoding %s on the CPU%s\n",
+                   hwdec ? "Hardware" : "Software", av_get_pix_fmt_name(s->up_fmt),
+                   hwdec ? " after downloading" : "");
+
+        if (hwdec) {
+            s->hwfc_ref = av_buffer_ref(in_avctx->hw_frames_ctx);
+            if (!s->hwfc_ref)
+                return AVERROR(ENOMEM);
+        }
+    } else if (!hwdec) {
+        if (verbose) {
+            printf("Software decoding\n");
+            printf("Creating frame context to upload hardware frames into\n");
+        }
 
-        hwfc_ref = av_hwframe_ctx_alloc(hw_dev_ref);
+        s->hwfc_ref = hwfc_ref = av_hwframe_ctx_alloc(hw_dev_ref);
         if (!hwfc_ref)
-            return ENOMEM;
+            return AVERROR(ENOMEM);
+
+        /* With GPU conversion, frames get uploaded exactly as decoded */
+        enum AVPixelFormat enc_fmt = negotiate_format(out_enc, 1, hw_dev_ref,
+                                                      in_avctx->pix_fmt,
+                                                      &s->conv_path);
+        if (enc_fmt == AV_PIX_FMT_NONE)
+            return AVERROR(ENOSYS);
+        int gpu_convert = opts->gpu_convert && enc_fmt != in_avctx->pix_fmt;
 
         AVHWFramesContext *hwfc = (AVHWFramesContext *)hwfc_ref->data;
         hwfc->format = AV_PIX_FMT_VULKAN;
-        hwfc->sw_format = remap_pixfmt(in_avctx->pix_fmt);
+        hwfc->sw_format = gpu_convert ? in_avctx->pix_fmt : enc_fmt;
         hwfc->width  = in_avctx->width;
         hwfc->height = in_avctx->height;
 
+        int map_decode = 0;
+        if (opts->upload != UPLOAD_COPY) {
+            AVVulkanFramesContext *vkfc = hwfc->hwctx;
+
+            /* Only linear images can be mapped into host memory */
+            vkfc->tiling = VK_IMAGE_TILING_LINEAR;
+
+            /* Leave room for the decoder's padding if it can decode into
+             * the frames directly */
+            map_decode = in_avctx->get_buffer2 == map_get_buffer &&
+                         in_avctx->pix_fmt == hwfc->sw_format;
+            if (map_decode) {
+                hwfc->width  = FFMAX(in_avctx->width,  in_avctx->coded_width);
+                hwfc->height = FFMAX(in_avctx->height, in_avctx->coded_height);
+                avcodec_align_dimensions2(in_avctx, &hwfc->width, &hwfc->height,
+                                          s->map_linesize_align);
+                for (int i = 0; i < FF_ARRAY_ELEMS(s->map_linesize_align); i++)
+                    s->map_linesize_align[i] = FFMAX(s->map_linesize_align[i],
+                                                     av_cpu_max_align());
+            }
+        }
+
         err = av_hwframe_ctx_init(hwfc_ref);
         if (err < 0) {
             printf("Error creating frames context: %s\n", av_err2str(err));
-            return AVERROR(err);
+            return err;
+        }
+
+        s->up_fmt = hwfc->sw_format;
+        s->map_decode = map_decode;
+        if (opts->upload != UPLOAD_COPY && verbose)
+            printf("Uploading by %s into mapped frames\n",
+                   map_decode ? "decoding" : "writing");
+
+        if (gpu_convert) {
+            err = setup_gpu_convert(s, enc_fmt, &hwfc_ref, verbose);
+            if (err < 0)
+                return err;
         }
     } else {
-        printf("Hardware decoding\n");
+        if (verbose)
+            printf("Hardware decoding\n");
         hwfc_ref = in_avctx->hw_frames_ctx;
+        s->hwfc_ref = av_buffer_ref(hwfc_ref);
+        if (!s->hwfc_ref)
+            return AVERROR(ENOMEM);
+
+        /* FFV1 takes anything, so it only gets converted frames if asked
+         * to, but other encoders take fewer formats. Either way, frames
+         * never leave the GPU. */
+        enum AVPixelFormat sw_fmt = ((AVHWFramesContext *)hwfc_ref->data)->sw_format;
+        enum AVPixelFormat enc_fmt = negotiate_format(out_enc, 1, hw_dev_ref,
+                                                      sw_fmt, &s->conv_path);
+        if (enc_fmt == AV_PIX_FMT_NONE)
+            return AVERROR(ENOSYS);
+        if (opts->gpu_filter || (enc_fmt != sw_fmt &&
+                                 (out_enc->id != AV_CODEC_ID_FFV1 || opts->gpu_convert))) {
+            err = setup_gpu_convert(s, enc_fmt, &hwfc_ref, verbose);
+            if (err < 0)
+                return err;
+        } else {
+            s->conv_path = CONV_NONE;
+        }
     }
 
-    /* Encoder */
-    const AVCodec *out_enc = avcodec_find_encoder_by_name("ffv1_vulkan");
-    AVCodecContext *out_avctx = avcodec_alloc_context3(out_enc);
-    if (err < 0) {
-        printf("Error opening encoder\n");
-        return AVERROR(err);
+    AVStream *st = in_ctx->streams[sid];
+    s->frame_rate = st->avg_frame_rate.num ? st->avg_frame_rate :
+                    st->r_frame_rate.num   ? st->r_frame_rate   : av_make_q(25, 1);
+
+    /* Encoders */
+    if (verbose)
+        printf("Encoding with %s\n", out_enc->name);
+
+    s->encoders = av_calloc(nb_encoders, sizeof(*s->encoders));
+    if (!s->encoders)
+        return AVERROR(ENOMEM);
+
+    for (int i = 0; i < nb_encoders; i++) {
+        s->nb_encoders++;
+        err = init_encoder(s, &s->encoders[i], out_enc, hwfc_ref, hw_dev_ref);
+        if (err < 0)
+            return err;
     }
 
-    out_avctx->time_base = av_make_q(1, 1);
-    out_avctx->width = in_avctx->width;
-    out_avctx->height = in_avctx->height;
-    out_avctx->sw_pix_fmt = remap_pixfmt(in_avctx->sw_pix_fmt);
-    out_avctx->pix_fmt = AV_PIX_FMT_VULKAN;
-    out_avctx->hw_frames_ctx = hwfc_ref;
-    out_avctx->hw_device_ctx = hw_dev_ref;
+    if (nb_encoders > 1 && verbose)
+        printf("Encoding with %i encoders in parallel, in chunks of %i frames\n",
+               nb_encoders, opts->enc_chunk);
 
-    AVDictionary *opts = NULL;
-    av_dict_set(&opts, "level", "3", 0);
-//    av_dict_set(&opts, "strict", "-2", 0);
-    av_dict_set(&opts, "async_depth", "3", 0);
-    err = avcodec_open2(out_avctx, out_enc, &opts);
-    if (err < 0) {
-        printf("Error initializing encoder: %s\n", av_err2str(err));
-        return AVERROR(err);
+    if (opts->encode && opts->output && strcmp(opts->output, "null")) {
+        /* With several streams, each gets a file of its own */
+        char *path = indexed_path(opts->output, index);
+        if (!path)
+            return AVERROR(ENOMEM);
+
+        err = output_open(&s->out, path, opts->output_format,
+                          s->encoders[0].avctx, s->frame_rate);
+        if (err >= 0 && verbose)
+            printf("Writing the output to %s (%s)\n", path,
+                   s->out.mux->oformat->name);
+        av_free(path);
+        if (err < 0)
+            return err;
     }
 
-    int max_frames = 1000;
-    int64_t time_start = av_gettime();
-    int64_t time;
+    s->dec_name = in_dec->name;
+    s->enc_name = out_enc->name;
+    s->hwdec = hwdec;
+    s->dec_fmt = s->hwdec ? in_avctx->sw_pix_fmt : in_avctx->pix_fmt;
+    s->enc_fmt = s->sw_encode ? s->up_fmt :
+                 ((AVHWFramesContext *)hwfc_ref->data)->sw_format;
+    if (verbose)
+        printf("Format: %s to %s, %s%s\n", av_get_pix_fmt_name(s->dec_fmt),
+               av_get_pix_fmt_name(s->enc_fmt), conv_names[s->conv_path],
+               s->conv_path == CONV_NONE ? "" : s->graph ? " on the GPU" : " on the CPU");
+    s->max_frames = opts->frames ? opts->frames : opts->duration ? INT_MAX : 1000;
 
-    AVPacket *out_pkt = av_packet_alloc();
-    AVFrame *hw_frame = av_frame_alloc();
-    AVFrame *temp = av_frame_alloc();
+    /* Room for every frame's samples up front, so that none are allocated
+     * for within the timed loop */
+    int nb_samples = opts->duration ?
+                     FFMIN(opts->duration * STAGE_RESERVE_FPS / 1000000, s->max_frames) :
+                     s->max_frames;
+    for (int i = 0; i < NB_STAGES; i++) {
+        stage_reserve(&s->stats[i], nb_samples);
+        if (s->gpu_timer) /* Shared by the streams of its device */
+            stage_reserve(&s->gpu_timer->stats[i], nb_samples);
+    }
+    /* Frames are shared out between the encoders, a chunk at a time */
+    int nb_enc_samples = nb_samples / s->nb_encoders + opts->enc_chunk;
+    for (int i = 0; i < s->nb_encoders; i++) {
+        stage_reserve(&s->encoders[i].stats, nb_enc_samples);
+        if (opts->latency)
+            stage_reserve(&s->encoders[i].latency, nb_enc_samples);
+    }
+    if (opts->latency)
+        stage_reserve(&s->latency, nb_samples);
 
-    SwsContext *swc = sws_alloc_context();
+    s->temp = av_frame_alloc();
+    s->swc = sws_alloc_context();
+    if (!s->temp || !s->swc)
+        return AVERROR(ENOMEM);
 
-    av_log_set_level(AV_LOG_INFO);
+    /* Conversions are pure repacks, with no resizing, so there is no need
+     * for a high quality scaler */
+    err = av_opt_set_int(s->swc, "threads", opts->sws_threads, 0);
+    if (err >= 0)
+        err = av_opt_set(s->swc, "sws_flags", opts->sws_flags, 0);
+    if (err < 0) {
+        printf("Error configuring swscale: %s\n", av_err2str(err));
+        return err;
+    }
 
-    if (argc > 4 && !strcmp(argv[4], "1"))
-        printf("Decoding and encoding %i frames\n", max_frames);
-    else
-        printf("Decoding %i frames\n", max_frames);
+    if (opts->repack != REPACK_SWS && s->conv_path == CONV_REPACK && !s->graph) {
+        int threads = opts->sws_threads ? opts->sws_threads : av_cpu_count();
+        err = repack_init(&s->repack, s->dec_fmt, s->up_fmt,
+                          opts->repack == REPACK_C ? 0 : av_get_cpu_flags(),
+                          threads);
+        if (err < 0 && err != AVERROR(ENOSYS)) {
+            printf("Error initializing repacking: %s\n", av_err2str(err));
+            return err;
+        }
+    }
 
-    for (int i = 0; i < max_frames; i++) {
-        err = decode_frame(in_avctx, pkt, frame);
+    if (opts->upload == UPLOAD_FUSED && s->conv_path != CONV_NONE &&
+        !s->graph && !s->repack.slice) {
+        err = fused_sws_init(s, in_avctx->width, in_avctx->height);
         if (err < 0) {
-            printf("Error decoding frame: %s\n", av_err2str(err));
-            return AVERROR(err);
+            printf("Error initializing swscale: %s\n", av_err2str(err));
+            return err;
+        }
+    }
+
+    if (s->conv_path == CONV_NONE)
+        s->converter = "none";
+    else if (s->graph)
+        s->converter = "gpu";
+    else
+        s->converter = s->repack.slice ? s->repack.dsp.name : "swscale";
+
+    if (opts->repack_bench && verbose) {
+        if (!s->repack.slice) {
+            printf("No repack kernel for %s to %s\n", av_get_pix_fmt_name(s->dec_fmt),
+                   av_get_pix_fmt_name(s->up_fmt));
+            return AVERROR(EINVAL);
         }
+        err = repack_bench(s, in_avctx->width, in_avctx->height);
+        if (err < 0)
+            return err;
+    }
 
-        AVFrame *src = frame;
-        if (!frame->hw_frames_ctx &&
-            frame->format != remap_pixfmt(in_avctx->sw_pix_fmt)) {
-            temp->width = frame->width;
-            temp->height = frame->height;
-            temp->format = remap_pixfmt(in_avctx->sw_pix_fmt);
+    return 0;
+}
 
-            err = av_frame_get_buffer(temp, 0);
-            if (err < 0) {
-                printf("Error allocating temporary frame: %s\n", av_err2str(err));
-                return AVERROR(err);
-            }
+static void bench_uninit(BenchContext *s)
+{
+    for (int i = 0; i < s->nb_cache; i++)
+        av_frame_free(&s->cache[i]);
+    av_freep(&s->cache);
+    if (s->cache_map)
+        munmap(s->cache_map, s->cache_map_size);
+    av_frame_free(&s->temp);
+    av_buffer_pool_uninit(&s->temp_pool);
+    sws_free_context(&s->swc);
+    sws_free_context(&s->fused_swc);
+    repack_uninit(&s->repack);
+    avfilter_graph_free(&s->graph);
+    for (int i = 0; i < s->nb_encoders; i++) {
+        avcodec_free_context(&s->encoders[i].avctx);
+        av_packet_free(&s->encoders[i].pkt);
+        av_freep(&s->encoders[i].stats.samples);
+        av_freep(&s->encoders[i].latency.samples);
+        av_freep(&s->encoders[i].stamps);
+    }
+    av_freep(&s->encoders);
+    output_close(&s->out);
+    avcodec_free_context(&s->in.dec);
+    av_buffer_unref(&s->hwfc_ref);
+    av_packet_free(&s->in.pkt);
+    avformat_close_input(&s->in.fmt_ctx);
+    input_io_close(&s->in.io);
+    stage_stats_free(s->stats);
+    av_freep(&s->latency.samples);
+    av_buffer_pool_uninit(&s->in.stamps);
+    av_freep(&s->enc_opts);
+}
 
-            err = sws_scale_frame(swc, temp, frame);
-            if (err < 0) {
-                printf("Error scaling frame: %s\n", av_err2str(err));
-                return AVERROR(err);
-            }
+/* The outcome of one run, for the table printed after a sweep */
+typedef struct SweepResult {
+    char desc[256]; /* Values of the swept options */
+    int err;
+    double fps;
+    double bytes_per_frame;
+} SweepResult;
+
+/* Runs all streams once, from setting them up to writing the results. index
+ * tells the runs of a sweep apart. */
+static int run_bench(BenchRun *run, const BenchOptions *opts, int index,
+                     SweepResult *res)
+{
+    int err = 0, nb_timers = 0, nb_init = 0;
+
+    av_log_set_level(AV_LOG_VERBOSE);
+
+    /* Setting the streams up counts towards the peak too */
+    if (peak_rss_reset() < 0 && index)
+        printf("Peak memory use is that of all runs so far\n");
+
+    for (int i = 0; i < run->nb_devices; i++) {
+        BenchDevice *dev = &run->devices[i];
+
+        dev->nb_streams = 0;
+        dev->nb_frames = 0;
+        dev->fps = 0;
 
-            src = temp;
+        /* Shared by all streams of the device, as it times the whole device */
+        if (opts->gpu_timing) {
+            dev->gpu_timer = (GPUTimer) { 0 };
+            err = gpu_timer_init(&dev->gpu_timer, dev->ref);
+            if (err < 0)
+                goto end;
+            nb_timers++;
         }
+    }
 
-        if (!(desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
-            err = av_hwframe_get_buffer(hwfc_ref, hw_frame, 0);
-            if (err < 0) {
-                printf("Error allocating hardware frame\n");
-                return AVERROR(err);
-            }
+    /* By default, each device gets a stream */
+    run->nb_streams = opts->streams ? opts->streams : run->nb_devices;
 
-            err = av_hwframe_transfer_data(hw_frame, src, 0);
-            if (err < 0) {
-                printf("Error uploading frame: %s\n", av_err2str(err));
-                return AVERROR(err);
-            }
-            src = hw_frame;
+    /* Decoders keep pointers to their stream's context, so it never moves */
+    run->streams = av_calloc(run->nb_streams, sizeof(*run->streams));
+    if (!run->streams) {
+        err = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    /* Each stream is set up bound to its own node, and nothing else */
+    cpu_set_t cpus;
+    if (opts->numa) {
+        err = pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err) {
+            err = AVERROR(err);
+            printf("Error getting the CPU affinity: %s\n", av_err2str(err));
+            goto end;
         }
+    }
 
-        if (argc > 3 && !strcmp(argv[4], "1")) {
-again:
-            err = avcodec_send_frame(out_avctx, src);
-            if (err < 0 && err != AVERROR(EAGAIN)) {
-                printf("Error sending frame for encoding: %s\n", av_err2str(err));
-                return AVERROR(err);
-            }
+    for (; nb_init < run->nb_streams; nb_init++) {
+        BenchContext *s = &run->streams[nb_init];
+        BenchDevice *dev = &run->devices[nb_init % run->nb_devices];
+        int numa = opts->numa && dev->numa_node >= 0;
 
-            err = avcodec_receive_packet(out_avctx, out_pkt);
-            if (err < 0 && err != AVERROR(EAGAIN)) {
-                printf("Error receiving encoded packet: %s\n", av_err2str(err));
-                return AVERROR(err);
+        /* Threads and buffers the stream sets up land on the node too */
+        if (numa) {
+            err = numa_bind(dev->numa_node, &dev->numa_cpus);
+            if (err < 0) {
+                printf("Error binding to NUMA node %i: %s\n", dev->numa_node,
+                       av_err2str(err));
+                goto end;
             }
-            if (err == AVERROR(EAGAIN))
-                goto again;
         }
 
-        time = av_gettime() - time_start;
-        printf("\rFrames done: %i, fmt: %i, fps: %f", i + 1, in_avctx->pix_fmt,
-               (float)i / ((float)time/(1000.0f*1000.0f)));
-        fflush(stdout);
+        err = bench_init(s, opts, dev->ref,
+                         opts->gpu_timing ? &dev->gpu_timer : NULL, nb_init);
+        if (numa)
+            numa_unbind(&cpus);
+        s->device = nb_init % run->nb_devices;
+        if (numa) {
+            s->numa_cpus = &dev->numa_cpus;
+            s->numa_cpus_str = dev->numa_cpus_str;
+            s->numa_node = dev->numa_node;
+        }
+        dev->nb_streams++;
+        if (err < 0) {
+            if (run->nb_streams > 1)
+                printf("Error setting up stream %i\n", nb_init);
+            nb_init++;
+            goto end;
+        }
+    }
+
+    av_log_set_level(AV_LOG_INFO);
 
-        av_frame_unref(temp);
-        av_frame_unref(hw_frame);
-        av_frame_unref(frame);
-        av_packet_unref(out_pkt);
+    printf("%s", opts->encode ? "Decoding and encoding" : "Decoding");
+    if (opts->duration)
+        printf(" for %f seconds", opts->duration / 1e6);
+    else
+        printf(" %s%i frames", opts->demux && !opts->loop ? "up to " : "",
+               run->streams[0].max_frames);
+    if (opts->cache)
+        printf(" from %i cached frames", run->streams[0].nb_cache);
+    if (opts->warmup)
+        printf(" after %i warm-up frames", opts->warmup);
+    if (run->nb_streams > 1)
+        printf(", in each of %i streams", run->nb_streams);
+    if (run->nb_devices > 1)
+        printf(" over %i devices", run->nb_devices);
+    printf("%s\n", opts->pipeline ? ", pipelined" : "");
+
+    ProgressReporter progress;
+    err = progress_start(&progress, run->streams, run->nb_streams, opts->progress);
+    if (err < 0) {
+        printf("Error starting progress reporter: %s\n", av_err2str(err));
+        goto end;
     }
+
+    err = run_streams(run->streams, run->nb_streams);
+    if (opts->numa)
+        numa_unbind(&cpus);
+
+    progress_stop(&progress);
     printf("\n");
-    time = av_gettime() - time_start;
-    printf("Time = %f; fps = %f\n", (float)time/(1000.0f*1000.0f),
-           (float)max_frames / ((float)time/(1000.0*1000.0f)));
+    if (err < 0) {
+        printf("Error running benchmark: %s\n", av_err2str(err));
+        goto end;
+    }
+
+    /* Before the streams free anything */
+    run->peak_rss = peak_rss();
+    for (int i = 0; i < run->nb_devices; i++)
+        device_memory(&run->devices[i]);
+
+    if (opts->gpu_timing)
+        for (int i = 0; i < run->nb_devices; i++)
+            gpu_timer_flush(&run->devices[i].gpu_timer);
+
+    bench_aggregate(run);
+    BenchContext *total = &run->total;
+
+    if (!total->measuring)
+        printf("Input ended before the warm-up of %i frames was over\n",
+               opts->warmup);
+
+    if (run->nb_streams > 1)
+        for (int i = 0; i < run->nb_streams; i++)
+            printf("Stream %i: %i frames, time = %f; fps = %f; "
+                   "%lli allocations\n", i,
+                   run->streams[i].nb_frames, run->streams[i].elapsed / 1e6,
+                   bench_fps(&run->streams[i]),
+                   (long long)run->streams[i].allocs.nb_allocs);
+
+    if (run->nb_devices > 1) {
+        for (int i = 0; i < run->nb_devices; i++) {
+            BenchDevice *dev = &run->devices[i];
+            printf("Device %i (%s): %i streams, %i frames, fps = %f\n", i,
+                   dev->name, dev->nb_streams, dev->nb_frames, dev->fps);
+            if (opts->gpu_timing)
+                print_gpu_timer_stats(&dev->gpu_timer, dev->nb_frames);
+        }
+    }
+
+    if (total->measuring)
+        printf("Time = %f; fps = %f\n", (float)total->elapsed/(1000.0f*1000.0f),
+               (float)total->nb_frames / ((float)total->elapsed/(1000.0*1000.0f)));
+
+    print_stats(total);
+
+    if (run->peak_rss >= 0)
+        printf("Peak RSS: %.1f MiB\n", run->peak_rss / 1048576.0);
+    for (int i = 0; i < run->nb_devices; i++) {
+        BenchDevice *dev = &run->devices[i];
+        if (dev->mem_local < 0)
+            continue;
+        if (run->nb_devices > 1)
+            printf("Device %i memory", i);
+        else
+            printf("Device memory");
+        printf(": %.1f MiB device-local, %.1f MiB host, in use\n",
+               dev->mem_local / 1048576.0, dev->mem_host / 1048576.0);
+    }
+
+    OutputSummary out;
+    output_summarize(total, &out);
+    res->fps = bench_fps(total);
+    res->bytes_per_frame = out.bytes_per_frame;
+
+    /* Each run of a sweep gets a JSON file of its own, while CSV rows
+     * accumulate anyway */
+    if (opts->json_path) {
+        char *path = indexed_path(opts->json_path, index);
+        if (path)
+            write_json(run, path);
+        av_free(path);
+    }
+    if (opts->csv_path)
+        write_csv(run, opts->csv_path);
+
+    stage_stats_free(total->stats);
+    av_freep(&total->latency.samples);
+
+end:
+    for (int i = 0; i < nb_init; i++)
+        bench_uninit(&run->streams[i]);
+    av_freep(&run->streams);
+    for (int i = 0; i < nb_timers; i++)
+        gpu_timer_uninit(&run->devices[i].gpu_timer);
+
+    return err;
+}
+
+static void print_sweep(const SweepResult *results, int nb_results)
+{
+    const SweepResult *best = NULL;
+
+    printf("\n%-40s %12s %16s\n", "Encoder options", "fps", "bytes/frame");
+    for (int i = 0; i < nb_results; i++) {
+        const SweepResult *res = &results[i];
+        if (res->err < 0) {
+            printf("%-40s %12s\n", res->desc, "failed");
+            continue;
+        }
+        printf("%-40s %12.2f %16.0f\n", res->desc, res->fps,
+               res->bytes_per_frame);
+        if (!best || res->fps > best->fps)
+            best = res;
+    }
+
+    if (best)
+        printf("Fastest: %s\n", best->desc);
+}
+
+int main(int argc, const char **argv)
+{
+    int err;
+    BenchOptions opts = { 0 };
+
+    err = parse_options(&opts, argc, argv);
+    if (err < 0) {
+        print_usage(argv[0]);
+        free_options(&opts);
+        return AVERROR(err);
+    }
+
+    av_log_set_level(AV_LOG_VERBOSE);
+
+    /* Several devices can be given, separated by commas, and the streams
+     * are spread over them in turn */
+    BenchRun run = { 0 };
+    char *dev_list = av_strdup(opts.device);
+    if (!dev_list)
+        return ENOMEM;
+
+    char *save = NULL;
+    for (char *name = av_strtok(dev_list, ",", &save); name;
+         name = av_strtok(NULL, ",", &save)) {
+        if (run.nb_devices == MAX_DEVICES) {
+            printf("Too many devices, at most %i are supported\n", MAX_DEVICES);
+            return EINVAL;
+        }
+        run.devices[run.nb_devices++].name = name;
+    }
+    if (!run.nb_devices) {
+        printf("No device given\n");
+        return EINVAL;
+    }
+
+    for (int i = 0; i < run.nb_devices; i++) {
+        BenchDevice *dev = &run.devices[i];
+
+        err = av_hwdevice_ctx_create(&dev->ref, AV_HWDEVICE_TYPE_VULKAN,
+                                     dev->name, NULL, 0);
+        if (err < 0) {
+            printf("Error creating device %s: %s\n", dev->name, av_err2str(err));
+            goto end;
+        }
+
+        device_locate(dev);
+        if (dev->numa_node >= 0)
+            printf("Device %s: PCI %s, NUMA node %i, CPUs %s\n", dev->name,
+                   dev->pci, dev->numa_node, dev->numa_cpus_str);
+        else if (opts.numa)
+            printf("Device %s: NUMA node unknown, its streams are not pinned\n",
+                   dev->name);
+    }
+
+    /* -sweep runs every combination of the values in turn, the last
+     * option's changing the fastest */
+    int nb_runs = 1;
+    for (int i = 0; i < opts.nb_sweep; i++) {
+        nb_runs *= opts.sweep[i].nb_values;
+        if (nb_runs > 10000) {
+            printf("Too many combinations to sweep over\n");
+            err = AVERROR(EINVAL);
+            goto end;
+        }
+    }
+
+    SweepResult *results = av_calloc(nb_runs, sizeof(*results));
+    if (!results) {
+        err = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    for (int n = 0; n < nb_runs; n++) {
+        SweepResult *res = &results[n];
+        BenchOptions run_opts = opts;
+        int ret, sel[MAX_SWEEP], idx = n;
+
+        run_opts.enc_opts = NULL;
+        ret = av_dict_copy(&run_opts.enc_opts, opts.enc_opts, 0);
+
+        for (int i = opts.nb_sweep - 1; i >= 0; i--) {
+            sel[i] = idx % opts.sweep[i].nb_values;
+            idx /= opts.sweep[i].nb_values;
+        }
+        for (int i = 0; i < opts.nb_sweep && ret >= 0; i++) {
+            const SweepParam *p = &opts.sweep[i];
+            ret = set_enc_opt(&run_opts, p->key, p->values[sel[i]]);
+            av_strlcatf(res->desc, sizeof(res->desc), "%s%s=%s", i ? " " : "",
+                        p->key, p->values[sel[i]]);
+        }
+
+        if (nb_runs > 1)
+            printf("\nRun %i/%i: %s\n", n + 1, nb_runs, res->desc);
+        if (ret >= 0)
+            ret = run_bench(&run, &run_opts, n, res);
+        av_dict_free(&run_opts.enc_opts);
+
+        /* A failing combination does not stop the sweep */
+        res->err = ret;
+        if (ret < 0 && err >= 0)
+            err = ret;
+    }
+
+    if (nb_runs > 1)
+        print_sweep(results, nb_runs);
+    av_free(results);
+
+end:
+    for (int i = 0; i < run.nb_devices; i++) {
+        av_buffer_unref(&run.devices[i].ref);
+        av_free(run.devices[i].numa_cpus_str);
+    }
+    av_free(dev_list);
+    free_options(&opts);
+
+    return err < 0 ? AVERROR(err) : 0;
 }